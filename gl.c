@@ -1,9 +1,15 @@
+#define GL_GLEXT_PROTOTYPES
 #include <GL/gl.h>
 #include <GL/glx.h>
 #include "gl_common.c"
 
 static GLXContext glx_context;
 
+// Only used offscreen
+static EGLDisplay egl_display = EGL_NO_DISPLAY;
+static EGLSurface egl_surface = EGL_NO_SURFACE;
+static EGLContext egl_context = EGL_NO_CONTEXT;
+
 /*
  * Init
  */
@@ -61,14 +67,40 @@ static int init_x(char const *title, bool with_depth, bool with_alpha, bool with
     return 0;
 }
 
+static int init_offscreen(bool with_depth, bool with_alpha, bool with_msaa, int width, int height)
+{
+    egl_display = offscreen_display();
+    if (egl_display == EGL_NO_DISPLAY) return -1;
+
+    EGLint const ctxattr[] = { EGL_NONE };
+    if (0 != init_egl_pbuffer(egl_display, EGL_OPENGL_API, EGL_OPENGL_BIT,
+                              with_depth, with_alpha, with_msaa, width, height,
+                              &egl_surface, &egl_context, ctxattr)) {
+        return -1;
+    }
+
+    if (with_alpha) {
+        glEnable (GL_BLEND);
+        glBlendFunc (GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    }
+
+    return 0;
+}
+
 CAMLprim void gl_exit(void)
 {
     CAMLparam0();
 
-    print_error();
-    glXDestroyContext(x_display, glx_context);
-    XDestroyWindow(x_display, x_win);
-    XCloseDisplay(x_display);
+    if (offscreen) {
+        eglMakeCurrent(egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+        eglDestroyContext(egl_display, egl_context);
+        eglDestroySurface(egl_display, egl_surface);
+        eglTerminate(egl_display);
+    } else {
+        glXDestroyContext(x_display, glx_context);
+        XDestroyWindow(x_display, x_win);
+        XCloseDisplay(x_display);
+    }
 
     CAMLreturn0;
 }
@@ -126,134 +158,156 @@ static void reset_clear_depth(value depth)
 
 CAMLprim void gl_swap_buffers(void)
 {
+    delete_dead_objects();
+    frame_stats_before_swap();
     caml_release_runtime_system();
-    if (double_buffer) {
+    if (double_buffer && ! offscreen) {
         glXSwapBuffers(x_display, x_win);
     } else {
         glFlush();
     }
-    print_error();
     caml_acquire_runtime_system();
+    frame_stats_after_swap();
+    check_frame_errors();
+}
+
+CAMLprim value gl_set_swap_interval(value interval)
+{
+    int const i = Int_val(interval);
+    if (offscreen) return Val_bool(eglSwapInterval(egl_display, i));
+
+    char const *exts = glXQueryExtensionsString(x_display, DefaultScreen(x_display));
+    if (extension_in(exts, "GLX_EXT_swap_control")) {
+        PFNGLXSWAPINTERVALEXTPROC swap_interval =
+            (PFNGLXSWAPINTERVALEXTPROC)glXGetProcAddressARB((GLubyte const *)"glXSwapIntervalEXT");
+        if (swap_interval) {
+            swap_interval(x_display, x_win, i);
+            return Val_true;
+        }
+    }
+    if (extension_in(exts, "GLX_MESA_swap_control")) {
+        PFNGLXSWAPINTERVALMESAPROC swap_interval =
+            (PFNGLXSWAPINTERVALMESAPROC)glXGetProcAddressARB((GLubyte const *)"glXSwapIntervalMESA");
+        if (swap_interval) return Val_bool(0 == swap_interval(i));
+    }
+    // GLX_SGI_swap_control cannot disable vsync
+    if (i > 0 && extension_in(exts, "GLX_SGI_swap_control")) {
+        PFNGLXSWAPINTERVALSGIPROC swap_interval =
+            (PFNGLXSWAPINTERVALSGIPROC)glXGetProcAddressARB((GLubyte const *)"glXSwapIntervalSGI");
+        if (swap_interval) return Val_bool(0 == swap_interval(i));
+    }
+    return Val_false;
 }
 
 /*
  * Matrices
  */
 
-static void load_vector(GLdouble *m, value vector)
+static void load_matrix(double const *m)
 {
-    CAMLparam1(vector);
+    glLoadMatrixd(m);
+    check_error();
+}
 
-    // vector is a float array of length = 4
-    assert(Is_block(vector));
-    assert(Tag_val(vector) == Double_array_tag);
-    assert(Wosize_val(vector) == 4 * Double_wosize);
+CAMLprim void gl_set_depth_range(value near, value far)
+{
+    CAMLparam2(near, far);
+    assert(Is_block(near));
+    assert(Is_block(far));
 
-    for (unsigned c = 0; c < 4; c++) {
-        m[c] = Double_field(vector, c);
-    }
+    glDepthRange(Double_val(near), Double_val(far));
 
+    check_error();
     CAMLreturn0;
 }
 
-static void do_with_matrix(value matrix, void (*func)(GLdouble const *m))
-{
-    CAMLparam1(matrix);
-
-    // matrix is a float array array
-    assert(Is_block(matrix) && Tag_val(matrix) == 0);
-    assert(Wosize_val(matrix) == 4);
+/*
+ * Rendering
+ */
 
-    // We are going to extend-store the matrix here :
-    GLdouble m[4][4];
-    for (unsigned col = 0; col < 4; col++) {
-        load_vector(&m[col][0], Field(matrix, col));
+static GLenum gltype_of_bigarray(struct caml_ba_array const *arr)
+{
+    switch (arr->flags & CAML_BA_KIND_MASK) {
+        case CAML_BA_FLOAT32:
+            return GL_FLOAT;
+        default:
+            assert((arr->flags & CAML_BA_KIND_MASK) == CAML_BA_FLOAT64);
+            return GL_DOUBLE;
     }
+}
 
-    func(&m[0][0]);
+static bool has_uint_indices(void)
+{
+    return true;
+}
 
-    print_error();
-    CAMLreturn0;
+static bool has_float_textures(void)
+{
+    return true;
 }
 
-static void load_matrix(value matrix)
+static void texcoord1_pointer(float const *values, int nb_values)
 {
-    do_with_matrix(matrix, glLoadMatrixd);
+    (void)nb_values;
+    glTexCoordPointer(1, GL_FLOAT, 0, values);
 }
 
-CAMLprim void gl_set_depth_range(value near, value far)
+static bool has_timer_queries(void)
 {
-    CAMLparam2(near, far);
-    assert(Is_block(near));
-    assert(Is_block(far));
+    static int has_it = -1;
+    if (has_it < 0) has_it = has_extension("GL_ARB_timer_query");
+    return has_it;
+}
 
-    glDepthRange(Double_val(near), Double_val(far));
+static bool has_fences(void)
+{
+    static int has_it = -1;
+    if (has_it < 0) has_it = has_extension("GL_ARB_sync");
+    return has_it;
+}
 
-    print_error();
-    CAMLreturn0;
+static bool has_framebuffers(void)
+{
+    static int has_it = -1; // unknown yet
+    if (has_it < 0) has_it = has_extension("GL_ARB_framebuffer_object");
+    return has_it;
 }
 
-/*
- * Rendering
- */
+static bool draw_instanced(GLenum mode, value shape, struct caml_ba_array const *offsets, struct caml_ba_array const *scales, value color_specs)
+{
+    // The fixed pipeline has no per-instance attributes
+    (void)mode; (void)shape; (void)offsets; (void)scales; (void)color_specs;
+    return false;
+}
 
-CAMLprim void gl_render(value render_type, value vertices, value color_specs)
+static void multi_draw_arrays(GLenum mode, GLint const *firsts, GLsizei const *counts, GLsizei nb_draws)
 {
-    CAMLparam3(render_type, vertices, color_specs);
-    CAMLlocal1(colors);
-    assert(Is_long(render_type));
-    assert(Is_block(vertices) && Tag_val(vertices) == Custom_tag);
-    assert(Is_block(color_specs));
-    int nb_vertices = 0, nb_colors = 0;
-
-    // vertices
-    struct caml_ba_array *vertices_arr = Caml_ba_array_val(vertices);
-    assert(vertices_arr->num_dims == 2);
-    unsigned const v_dim = vertices_arr->dim[1];
-    assert(v_dim >= 2 && v_dim <= 4);
-    nb_vertices = vertices_arr->dim[0];
-    glVertexPointer(v_dim, GL_DOUBLE, 0, vertices_arr->data);
-    glEnableClientState(GL_VERTEX_ARRAY);
-
-    // colors
-    if (Tag_val(color_specs) == 0) {    // Array
-        colors = Field(color_specs, 0);
-        assert(Is_block(colors) && Tag_val(colors) == Custom_tag);
-        struct caml_ba_array *colors_arr = Caml_ba_array_val(colors);
-        assert(colors_arr->num_dims == 2);
-        unsigned const c_dim = colors_arr->dim[1];
-        assert(c_dim == 3 || c_dim == 4);
-        nb_colors = colors_arr->dim[0];
-        glColorPointer(c_dim, GL_DOUBLE, 0, colors_arr->data);
-        glEnableClientState(GL_COLOR_ARRAY);
-    } else {
-        assert(Tag_val(color_specs) == 1);
-        colors = Field(color_specs, 0);
-        unsigned const c_dim = Wosize_val(colors) / Double_wosize;
-        assert(c_dim == 3 || c_dim == 4);
-        assert(Is_block(colors));
-        assert(Tag_val(colors) == Double_array_tag);
-        if (c_dim == 4) {
-            glColor4f(
-                Double_field(colors, 0),
-                Double_field(colors, 1),
-                Double_field(colors, 2),
-                Double_field(colors, 3));
-        } else {
-            glColor3f(
-                Double_field(colors, 0),
-                Double_field(colors, 1),
-                Double_field(colors, 2));
-        }
-        glDisableClientState(GL_COLOR_ARRAY);
-    }
+    glMultiDrawArrays(mode, firsts, counts, nb_draws);
+    long nb_vertices = 0;
+    for (GLsizei d = 0; d < nb_draws; d++) nb_vertices += counts[d];
+    count_draws(1, nb_vertices);
+}
 
-    if (nb_colors > 0) assert(nb_colors == nb_vertices);
+static void set_uniq_color(value colors)
+{
+    CAMLparam1(colors);
+    assert(Is_block(colors));
+    assert(Tag_val(colors) == Double_array_tag);
+    unsigned const c_dim = Wosize_val(colors) / Double_wosize;
+    assert(c_dim == 3 || c_dim == 4);
 
-    GLenum const mode = glmode_of_render_type(Int_val(render_type));
-    glDrawArrays(mode, 0, nb_vertices);
+    if (c_dim == 4) {
+        glColor4f(
+            Double_field(colors, 0),
+            Double_field(colors, 1),
+            Double_field(colors, 2),
+            Double_field(colors, 3));
+    } else {
+        glColor3f(
+            Double_field(colors, 0),
+            Double_field(colors, 1),
+            Double_field(colors, 2));
+    }
 
-    print_error();
     CAMLreturn0;
 }
-
@@ -2,16 +2,28 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <limits.h>
 #include <string.h>
 #include <assert.h>
+#include <math.h>
+#include <time.h>
 #include <sys/select.h>
+#if defined(__AVX__)
+#   include <immintrin.h>
+#elif defined(__SSE2__)
+#   include <emmintrin.h>
+#endif
 #include <X11/Xlib.h>
 #include <X11/Xatom.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
 #include <caml/mlvalues.h>
 #include <caml/memory.h>
 #include <caml/alloc.h>
 #include <caml/bigarray.h>
 #include <caml/fail.h>
+#include <caml/custom.h>
+#include <caml/callback.h>
 
 #if CAML_VERSION > 31200
 #   include <caml/threads.h>
@@ -30,28 +42,279 @@
 #define UnZoom 3
 #define Move   4
 #define Resize 5
+#define KeyDown 6
+#define KeyUp  7
+#define Enter  8
+#define Leave  9
+#define Focus  10
+
+// Error checks modes, in the order of the error_checks type
+#define NoChecks    0
+#define CheckCalls  1
+#define CheckFrames 2
 
 static Display *x_display;
 static Window x_win;
 static int win_width, win_height;
 static XSetWindowAttributes win_attr = {
-    .event_mask = ExposureMask | ButtonPressMask | ButtonReleaseMask | PointerMotionMask | StructureNotifyMask,
+    .event_mask = ExposureMask | ButtonPressMask | ButtonReleaseMask | PointerMotionMask | StructureNotifyMask |
+                  KeyPressMask | KeyReleaseMask | EnterWindowMask | LeaveWindowMask | FocusChangeMask,
 };
 static bool double_buffer;  // set in init() and used in specific init* and swap_buffer.
+static bool offscreen;      // no X window, render into an EGL pbuffer instead
 static bool inited = false;
+static int error_checks = NoChecks;
 
 /*
- * Init
+ * Errors
  */
 
-static void print_error(void)
+static char const *string_of_error(GLenum err)
+{
+    switch (err) {
+        case GL_INVALID_ENUM:      return "GL_INVALID_ENUM";
+        case GL_INVALID_VALUE:     return "GL_INVALID_VALUE";
+        case GL_INVALID_OPERATION: return "GL_INVALID_OPERATION";
+        case GL_STACK_OVERFLOW:    return "GL_STACK_OVERFLOW";
+        case GL_STACK_UNDERFLOW:   return "GL_STACK_UNDERFLOW";
+        case GL_OUT_OF_MEMORY:     return "GL_OUT_OF_MEMORY";
+#       ifdef GL_INVALID_FRAMEBUFFER_OPERATION
+        case GL_INVALID_FRAMEBUFFER_OPERATION: return "GL_INVALID_FRAMEBUFFER_OPERATION";
+#       endif
+    }
+    return "Unknown GL error";
+}
+
+// Several error flags may be set. (Bounded since a lost context may
+// report errors forever.)
+static void forget_errors(void)
+{
+    for (unsigned i = 0; i < 16 && glGetError() != GL_NO_ERROR; i++) ;
+}
+
+// Pop all error flags and raise Gl_error for the first one, if any.
+static void raise_error(char const *where)
 {
-    GLenum err = glGetError();
+    GLenum const err = glGetError();
     if (err == GL_NO_ERROR) return;
 
-    fprintf(stderr, "GLError: %d\n", err);
+    forget_errors();
+
+    char msg[128];
+    snprintf(msg, sizeof(msg), "%s (0x%x) in %s", string_of_error(err), (unsigned)err, where);
+
+    static value const *exn = NULL;
+    if (! exn) exn = caml_named_value("glop_gl_error");
+    if (! exn) {
+        fprintf(stderr, "GLError: %s\n", msg);
+        return;
+    }
+    caml_raise_with_string(*exn, msg);
+}
+
+// Called after each GL call (glGetError may stall the pipeline, so it's off by default)
+#define check_error() do { \
+    if (error_checks == CheckCalls) raise_error(__func__); \
+} while (0)
+
+// Called once per frame, after the swap
+static void check_frame_errors(void)
+{
+    if (error_checks == CheckFrames) raise_error("last frame");
+    else if (error_checks == CheckCalls) raise_error("gl_swap_buffers");
+}
+
+CAMLprim void gl_set_error_checks(value mode)
+{
+    assert(Is_long(mode));
+    // Errors that happened before are not reported
+    if (inited) forget_errors();
+    error_checks = Int_val(mode);
+}
+
+/*
+ * Frame statistics
+ */
+
+#define FRAME_HISTORY 64    // Number of frames remembered
+#define GPU_QUERIES 4       // Max number of frames in flight for GPU timing
+
+struct frame_stats {
+    long frame;
+    double cpu_time, swap_time, gpu_time;   // in seconds, gpu_time < 0 if not measured, NAN if undefined
+    long draw_calls, vertices;
+};
+
+static bool frame_stats_enabled;
+static struct frame_stats frame_history[FRAME_HISTORY];
+static long nb_frames;      // Frames recorded since frame stats were enabled
+static struct frame_stats this_frame;   // The frame being drawn
+static double frame_start, swap_start;
+
+// GPU timing needs timer queries, which GLES 1 lacks
+#ifdef GL_TIME_ELAPSED
+static bool has_timer_queries(void);
+static GLuint gpu_queries[GPU_QUERIES];
+static long gpu_query_frames[GPU_QUERIES];  // Frame measured by each query, or -1
+static bool gpu_query_disjoint[GPU_QUERIES];    // Result is undefined
+static bool gpu_query_running;
+#endif
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void count_draws(long nb_calls, long nb_vertices)
+{
+    this_frame.draw_calls += nb_calls;
+    this_frame.vertices += nb_vertices;
+}
+
+static void start_frame(void)
+{
+    this_frame = (struct frame_stats){ .frame = nb_frames, .gpu_time = -1. };
+    frame_start = now();
+#   ifdef GL_TIME_ELAPSED
+    if (! has_timer_queries()) return;
+    // Do not wait for the GPU: skip GPU timing of this frame if it's too late
+    unsigned const q = nb_frames % GPU_QUERIES;
+    if (gpu_query_frames[q] >= 0) return;
+    glBeginQuery(GL_TIME_ELAPSED, gpu_queries[q]);
+    gpu_query_frames[q] = nb_frames;
+    gpu_query_disjoint[q] = false;
+    gpu_query_running = true;
+#   endif
+}
+
+// Read back the GPU times of previous frames that are available.
+static void collect_gpu_times(void)
+{
+#   ifdef GL_TIME_ELAPSED
+    if (! has_timer_queries()) return;
+#   ifdef GL_GPU_DISJOINT_EXT
+    // With GL_EXT_disjoint_timer_query, a disjoint event (such as a change of
+    // GPU frequency) makes the results of all the queries in flight undefined
+    GLint disjoint = 0;
+    glGetIntegerv(GL_GPU_DISJOINT_EXT, &disjoint);
+    if (disjoint) {
+        for (unsigned q = 0; q < GPU_QUERIES; q++) {
+            if (gpu_query_frames[q] >= 0) gpu_query_disjoint[q] = true;
+        }
+    }
+#   endif
+    for (unsigned q = 0; q < GPU_QUERIES; q++) {
+        long const frame = gpu_query_frames[q];
+        if (frame < 0 || (frame == this_frame.frame && gpu_query_running)) continue;
+        GLuint available;
+        glGetQueryObjectuiv(gpu_queries[q], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (! available) continue;
+        GLuint64 ns;
+        glGetQueryObjectui64v(gpu_queries[q], GL_QUERY_RESULT, &ns);
+        if (nb_frames - frame <= FRAME_HISTORY) {
+            frame_history[frame % FRAME_HISTORY].gpu_time =
+                gpu_query_disjoint[q] ? NAN : ns * 1e-9;
+        }
+        gpu_query_frames[q] = -1;
+    }
+#   endif
+}
+
+// To be called by gl_swap_buffers before swapping...
+static void frame_stats_before_swap(void)
+{
+    if (! frame_stats_enabled) return;
+    swap_start = now();
+    this_frame.cpu_time = swap_start - frame_start;
+#   ifdef GL_TIME_ELAPSED
+    if (gpu_query_running) {
+        glEndQuery(GL_TIME_ELAPSED);
+        gpu_query_running = false;
+    }
+#   endif
+}
+
+// ...and after.
+static void frame_stats_after_swap(void)
+{
+    if (! frame_stats_enabled) return;
+    this_frame.swap_time = now() - swap_start;
+    frame_history[nb_frames % FRAME_HISTORY] = this_frame;
+    nb_frames ++;
+    collect_gpu_times();
+    start_frame();
+    check_error();
+}
+
+CAMLprim void gl_set_frame_stats(value enabled)
+{
+    bool const enable = Bool_val(enabled);
+    if (enable == frame_stats_enabled) return;
+    frame_stats_enabled = enable;
+
+#   ifdef GL_TIME_ELAPSED
+    if (! has_timer_queries()) return;
+    if (enable) {
+        glGenQueries(GPU_QUERIES, gpu_queries);
+        for (unsigned q = 0; q < GPU_QUERIES; q++) gpu_query_frames[q] = -1;
+    } else {
+        if (gpu_query_running) glEndQuery(GL_TIME_ELAPSED);
+        gpu_query_running = false;
+        glDeleteQueries(GPU_QUERIES, gpu_queries);
+    }
+    check_error();
+#   endif
+
+    if (enable) {
+        nb_frames = 0;
+        start_frame();
+    }
+}
+
+CAMLprim value gl_frame_stats(void)
+{
+    CAMLparam0();
+    CAMLlocal2(stats, frame);
+
+    long const nb_stats = nb_frames < FRAME_HISTORY ? nb_frames : FRAME_HISTORY;
+    stats = caml_alloc_tuple(nb_stats);
+    for (long i = 0; i < nb_stats; i++) {
+        struct frame_stats const *f = frame_history + (nb_frames - nb_stats + i) % FRAME_HISTORY;
+        frame = caml_alloc_tuple(6);
+        Store_field(frame, 0, Val_long(f->frame));
+        Store_field(frame, 1, caml_copy_double(f->cpu_time));
+        Store_field(frame, 2, caml_copy_double(f->swap_time));
+        Store_field(frame, 3, caml_copy_double(f->gpu_time < 0. ? NAN : f->gpu_time));
+        Store_field(frame, 4, Val_long(f->draw_calls));
+        Store_field(frame, 5, Val_long(f->vertices));
+        Store_field(stats, i, frame);
+    }
+
+    CAMLreturn(stats);
+}
+
+CAMLprim value gl_frame_clock(void)
+{
+    CAMLparam0();
+    CAMLreturn(caml_copy_double(now()));
+}
+
+CAMLprim value gl_frame_draw_calls(void)
+{
+    return Val_long(this_frame.draw_calls);
+}
+
+CAMLprim value gl_frame_vertices(void)
+{
+    return Val_long(this_frame.vertices);
 }
 
+/*
+ * Init
+ */
+
 static bool set_window_size(int width, int height)
 {
     if (width == win_width && height == win_height) return false;
@@ -61,13 +324,100 @@ static bool set_window_size(int width, int height)
 }
 
 static int init_x(char const *title, bool with_depth, bool with_alpha, bool with_msaa, int width, int height);
+static int init_offscreen(bool with_depth, bool with_alpha, bool with_msaa, int width, int height);
+
+// Get an EGL display that needs neither X nor GPU if possible (Mesa)
+static EGLDisplay offscreen_display(void)
+{
+    EGLDisplay display = EGL_NO_DISPLAY;
+
+    PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (get_platform_display) {
+        display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    }
+    if (display == EGL_NO_DISPLAY) {
+        display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    }
+    if (display == EGL_NO_DISPLAY) {
+        fprintf(stderr, "Got no EGL display.\n");
+        return EGL_NO_DISPLAY;
+    }
+
+    if (! eglInitialize(display, NULL, NULL)) {
+        fprintf(stderr, "Unable to initialize EGL\n");
+        return EGL_NO_DISPLAY;
+    }
+
+    return display;
+}
+
+// Create a pbuffer surface of the given size and a context for the given API
+static int init_egl_pbuffer(EGLDisplay display, EGLenum api, EGLint renderable_type,
+                            bool with_depth, bool with_alpha, bool with_msaa, int width, int height,
+                            EGLSurface *surface, EGLContext *context, EGLint const *ctxattr)
+{
+    if (! eglBindAPI(api)) {
+        fprintf(stderr, "Cannot bind EGL API (eglError: %d)\n", eglGetError());
+        return -1;
+    }
+
+    EGLint attrs[] = {
+        EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+        EGL_RENDERABLE_TYPE, renderable_type,
+        EGL_RED_SIZE, 4, EGL_GREEN_SIZE, 4, EGL_BLUE_SIZE, 4,
+        EGL_ALPHA_SIZE, with_alpha ? 4 : 0,
+        EGL_DEPTH_SIZE, with_depth ? 4 : 0,
+        EGL_SAMPLE_BUFFERS, with_msaa ? 1 : 0,
+        EGL_SAMPLES, with_msaa ? 4 : 0,
+        EGL_NONE
+    };
+
+    EGLConfig config;
+    EGLint num_config;
+    if (! eglChooseConfig(display, attrs, &config, 1, &num_config) || num_config != 1) {
+        fprintf(stderr, "Failed to choose offscreen config (eglError: %d)\n", eglGetError());
+        return -1;
+    }
+
+    EGLint const pbuffer_attrs[] = {
+        EGL_WIDTH, width,
+        EGL_HEIGHT, height,
+        EGL_NONE
+    };
+    *surface = eglCreatePbufferSurface(display, config, pbuffer_attrs);
+    if (*surface == EGL_NO_SURFACE) {
+        fprintf(stderr, "Unable to create EGL pbuffer (eglError: %d)\n", eglGetError());
+        return -1;
+    }
+
+    *context = eglCreateContext(display, config, EGL_NO_CONTEXT, ctxattr);
+    if (*context == EGL_NO_CONTEXT) {
+        fprintf(stderr, "Unable to create EGL context (eglError: %d)\n", eglGetError());
+        return -1;
+    }
+
+    if (EGL_TRUE != eglMakeCurrent(display, *surface, *surface, *context)) {
+        fprintf(stderr, "Unable to associate context and surface (eglError: %d)\n", eglGetError());
+        return -1;
+    }
+
+    return 0;
+}
 
 static int init(char const *title, bool with_depth, bool with_alpha, bool with_msaa, int width, int height)
 {
-    if (0 == XInitThreads()) {
-        fprintf(stderr, "Cannot XInitThreads()\n");
+    int err;
+    if (offscreen) {
+        err = init_offscreen(with_depth, with_alpha, with_msaa, width, height);
+        win_width = width;
+        win_height = height;
+    } else {
+        if (0 == XInitThreads()) {
+            fprintf(stderr, "Cannot XInitThreads()\n");
+        }
+        err = init_x(title, with_depth, with_alpha, with_msaa, width, height);
     }
-    int err = init_x(title, with_depth, with_alpha, with_msaa, width, height);
     if (0 != err) return err;
     glShadeModel(GL_FLAT);
     glEnable(GL_MULTISAMPLE);
@@ -75,22 +425,23 @@ static int init(char const *title, bool with_depth, bool with_alpha, bool with_m
     glDisable(GL_DEPTH_TEST);
     (void)set_window_size(win_width, win_height);
     glViewport(0, 0, win_width, win_height);
-    print_error();
+    check_error();
     inited = true;
 
     return 0;
 }
 
-CAMLprim void gl_init_native(value with_depth_, value with_alpha_, value double_buffer_, value with_msaa_, value title, value width, value height)
+CAMLprim void gl_init_native(value with_depth_, value with_alpha_, value double_buffer_, value with_msaa_, value offscreen_, value title, value width, value height)
 {
-    CAMLparam5(with_depth_, with_alpha_, double_buffer_, with_msaa_, title);
-    CAMLxparam2(width, height);
+    CAMLparam5(with_depth_, with_alpha_, double_buffer_, with_msaa_, offscreen_);
+    CAMLxparam3(title, width, height);
 
     assert(Tag_val(title) == String_tag);
     bool with_depth = Is_block(with_depth_) && Val_true == Field(with_depth_, 0);
     bool with_alpha = Is_block(with_alpha_) && Val_true == Field(with_alpha_, 0);
     double_buffer = !(Is_block(double_buffer_) && Val_false == Field(double_buffer_, 0));
     bool with_msaa = Is_block(with_msaa_) && Val_true == Field(with_msaa_, 0);
+    offscreen = Is_block(offscreen_) && Val_true == Field(offscreen_, 0);
 
     if (0 != init(String_val(title), with_depth, with_alpha, with_msaa, Long_val(width), Long_val(height))) {
         caml_failwith("Cannot open window");
@@ -101,9 +452,9 @@ CAMLprim void gl_init_native(value with_depth_, value with_alpha_, value double_
 
 CAMLprim void gl_init_bytecode(value *argv, int argn)
 {
-  assert(argn == 7);
+  assert(argn == 8);
   return gl_init_native(argv[0], argv[1], argv[2], argv[3],
-                        argv[4], argv[5], argv[6]);
+                        argv[4], argv[5], argv[6], argv[7]);
 }
 
 /*
@@ -187,6 +538,50 @@ static value resize_of(int width, int height)
     CAMLreturn(ret);
 }
 
+static value key_of(int tag, KeySym keysym, unsigned modifiers)
+{
+    CAMLparam0();
+    CAMLlocal2(key, ret);
+
+    key = caml_alloc(2, tag);  // Key_press (keysym, modifiers)
+    Store_field(key, 0, Val_long(keysym));
+    Store_field(key, 1, Val_int(modifiers));
+
+    ret = caml_alloc(1, 0); // Some...
+    Store_field(ret, 0, key);
+
+    CAMLreturn(ret);
+}
+
+static value crossing_of(int tag, int px, int py)
+{
+    CAMLparam0();
+    CAMLlocal2(crossing, ret);
+
+    crossing = caml_alloc(2, tag);  // Enter (x, y)
+    Store_field(crossing, 0, Val_int(px));
+    Store_field(crossing, 1, Val_int(py));
+
+    ret = caml_alloc(1, 0); // Some...
+    Store_field(ret, 0, crossing);
+
+    CAMLreturn(ret);
+}
+
+static value focus_of(bool focused)
+{
+    CAMLparam0();
+    CAMLlocal2(focus, ret);
+
+    focus = caml_alloc(1, Focus);  // Focus bool
+    Store_field(focus, 0, Val_bool(focused));
+
+    ret = caml_alloc(1, 0); // Some...
+    Store_field(ret, 0, focus);
+
+    CAMLreturn(ret);
+}
+
 static void wait_event(void)
 {
     while (0 == XPending(x_display)) {
@@ -224,48 +619,150 @@ static void compress_events(XEvent *prev_xev, int prev_type)
     }
 }
 
-static value next_event(bool wait)
+// An X event once decoded
+struct event {
+    int type;       // Clic, UnClic, Zoom, UnZoom, Move, Resize, KeyDown...
+    long x, y;      // or width, height for Resize, keysym, modifiers for keys
+    bool shifted;   // or focused for Focus
+    Time time;      // X server time in ms (0 if unknown)
+};
+
+// Last X server time seen in any event
+static Time last_event_time;
+
+// Pops the next X event (which must be pending) and decodes it into ev.
+// Returns false if the event is of no interest.
+static bool decode_xevent(struct event *ev)
+{
+    XEvent xev;
+    (void)XNextEvent(x_display, &xev);
+    ev->shifted = false;
+    ev->time = 0;
+
+    if (xev.type == MotionNotify) {
+        compress_events(&xev, MotionNotify);
+        ev->type = Move;
+        ev->x = xev.xmotion.x;
+        ev->y = xev.xmotion.y;
+        ev->time = xev.xmotion.time;
+        return true;
+    } else if (xev.type == KeyPress || xev.type == KeyRelease) {
+        ev->type = xev.type == KeyPress ? KeyDown : KeyUp;
+        ev->x = XLookupKeysym(&xev.xkey, 0);
+        ev->y = xev.xkey.state;
+        ev->time = xev.xkey.time;
+        return true;
+    } else if (xev.type == EnterNotify || xev.type == LeaveNotify) {
+        ev->type = xev.type == EnterNotify ? Enter : Leave;
+        ev->x = xev.xcrossing.x;
+        ev->y = xev.xcrossing.y;
+        ev->time = xev.xcrossing.time;
+        return true;
+    } else if (xev.type == FocusIn || xev.type == FocusOut) {
+        ev->type = Focus;
+        ev->shifted = xev.type == FocusIn;
+        return true;
+    } else if (xev.type == ButtonPress) {
+        ev->x = xev.xbutton.x;
+        ev->y = xev.xbutton.y;
+        ev->time = xev.xbutton.time;
+        switch (xev.xbutton.button) {
+            case Button1: case Button2: case Button3:
+                ev->type = Clic;
+                ev->shifted = xev.xbutton.state & ShiftMask;
+                return true;
+            case Button4:
+                ev->type = Zoom;
+                ev->shifted = xev.xbutton.state & ShiftMask;
+                return true;
+            case Button5:
+                ev->type = UnZoom;
+                return true;
+        }
+    } else if (xev.type == ButtonRelease) {
+        ev->type = UnClic;
+        ev->x = xev.xbutton.x;
+        ev->y = xev.xbutton.y;
+        ev->time = xev.xbutton.time;
+        return true;
+    } else if (xev.type == Expose) {
+        compress_events(&xev, Expose);
+        // We have in the event the size of the exposed area only
+        (void)set_window_size(win_width, win_height);
+        ev->type = Resize;
+        ev->x = win_width;
+        ev->y = win_height;
+        return true;
+    } else if (xev.type == ConfigureNotify) {
+        compress_events(&xev, ConfigureNotify);
+        if (set_window_size(xev.xconfigurerequest.width, xev.xconfigurerequest.height)) {
+            ev->type = Resize;
+            ev->x = xev.xconfigurerequest.width;
+            ev->y = xev.xconfigurerequest.height;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Same as above, but events without time get that of the previous one
+static bool decode_event(struct event *ev)
+{
+    if (! decode_xevent(ev)) return false;
+    if (ev->time) last_event_time = ev->time;
+    else ev->time = last_event_time;
+    return true;
+}
+
+static value value_of_event(struct event const *ev)
+{
+    switch (ev->type) {
+        case Clic:   return clic_of(ev->x, ev->y, ev->shifted);
+        case UnClic: return unclic_of(ev->x, ev->y);
+        case Zoom:   return zoom_of(ev->x, ev->y, ev->shifted);
+        case UnZoom: return unzoom_of(ev->x, ev->y);
+        case Move:   return move_of(ev->x, ev->y);
+        case KeyDown: case KeyUp: return key_of(ev->type, ev->x, ev->y);
+        case Enter: case Leave: return crossing_of(ev->type, ev->x, ev->y);
+        case Focus:  return focus_of(ev->shifted);
+        default:
+            assert(ev->type == Resize);
+            return resize_of(ev->x, ev->y);
+    }
+}
+
+// Returns false if there will never be any event
+static bool events_possible(bool wait)
 {
     // Typically, the init will be performed by another thread.
     // No need to protect inited here since OCaml threads are not running concurrently.
     if (! inited) {
         caml_release_runtime_system();  // yield CPU to other threads
         caml_acquire_runtime_system();
-        return Val_int(0);
+        return false;
     }
 
-    while (wait || XPending(x_display) > 0) {
-        XEvent xev;
+    if (offscreen) {
+        // There will never be any event
+        if (wait) {
+            caml_release_runtime_system();
+            while (true) select(0, NULL, NULL, NULL, NULL);
+        }
+        return false;
+    }
+
+    return true;
+}
+
+static value next_event(bool wait)
+{
+    if (! events_possible(wait)) return Val_int(0);
 
+    while (wait || XPending(x_display) > 0) {
+        struct event ev;
         wait_event();
-        (void)XNextEvent(x_display, &xev);
-
-        if (xev.type == MotionNotify) {
-            compress_events(&xev, MotionNotify);
-            return move_of(xev.xmotion.x, xev.xmotion.y);
-        } else if (xev.type == KeyPress) {
-        } else if (xev.type == ButtonPress) {
-            switch (xev.xbutton.button) {
-                case Button1: case Button2: case Button3:
-                    return clic_of(xev.xbutton.x, xev.xbutton.y, xev.xbutton.state & ShiftMask);
-                case Button4:
-                    return zoom_of(xev.xbutton.x, xev.xbutton.y, xev.xbutton.state & ShiftMask);
-                case Button5:
-                    return unzoom_of(xev.xbutton.x, xev.xbutton.y);
-            }
-        } else if (xev.type == ButtonRelease) {
-            return unclic_of(xev.xbutton.x, xev.xbutton.y);
-        } else if (xev.type == Expose) {
-            compress_events(&xev, Expose);
-            // We have in the event the size of the exposed area only
-            (void)set_window_size(win_width, win_height);
-            return resize_of(win_width, win_height);
-        } else if (xev.type == ConfigureNotify) {
-            compress_events(&xev, ConfigureNotify);
-            if (set_window_size(xev.xconfigurerequest.width, xev.xconfigurerequest.height)) {
-                return resize_of(xev.xconfigurerequest.width, xev.xconfigurerequest.height);
-            }
-        }
+        if (decode_event(&ev)) return value_of_event(&ev);
     }
 
     return Val_int(0);  // None
@@ -276,6 +773,56 @@ CAMLprim value gl_next_event(value wait)
     return next_event(Bool_val(wait));
 }
 
+CAMLprim value gl_next_timed_event(value wait)
+{
+    CAMLparam1(wait);
+    CAMLlocal3(ev, timed, ret);
+
+    ev = next_event(Bool_val(wait));
+    if (Is_long(ev)) CAMLreturn(Val_int(0));    // None
+
+    timed = caml_alloc_tuple(2);
+    Store_field(timed, 0, Field(ev, 0));
+    Store_field(timed, 1, Val_long(last_event_time));
+    ret = caml_alloc(1, 0); // Some...
+    Store_field(ret, 0, timed);
+
+    CAMLreturn(ret);
+}
+
+#define EVENT_COLUMNS 5 // type, x, y, flags, time
+
+// Decodes all pending events (waiting for at least one if wait) into the rows
+// of an int bigarray, without allocating. Returns the number of rows filled.
+CAMLprim value gl_poll_events(value wait, value events)
+{
+    CAMLparam2(wait, events);
+    struct caml_ba_array *arr = Caml_ba_array_val(events);
+    assert(arr->num_dims == 2 && arr->dim[1] == EVENT_COLUMNS);
+    assert((arr->flags & CAML_BA_KIND_MASK) == CAML_BA_CAML_INT);
+    intnat *rows = arr->data;
+    int nb_events = 0;
+
+    if (! events_possible(Bool_val(wait))) CAMLreturn(Val_int(0));
+
+    while (nb_events < arr->dim[0]) {
+        if (nb_events == 0 && Bool_val(wait)) wait_event();
+        else if (XPending(x_display) == 0) break;
+
+        struct event ev;
+        if (! decode_event(&ev)) continue;
+        intnat *row = rows + nb_events * EVENT_COLUMNS;
+        row[0] = ev.type;
+        row[1] = ev.x;
+        row[2] = ev.y;
+        row[3] = ev.shifted ? 1 : 0;
+        row[4] = ev.time;
+        nb_events ++;
+    }
+
+    CAMLreturn(Val_int(nb_events));
+}
+
 /*
  * Clear
  */
@@ -300,7 +847,7 @@ CAMLprim void gl_clear(value color_opt, value depth_opt)
 
     glClear(mask);
 
-    print_error();
+    check_error();
     CAMLreturn0;
 }
 
@@ -321,14 +868,23 @@ static void print_arr(GLfixed *arr_, unsigned vec_len, unsigned nb_vecs)
 }
 #endif
 
-static void load_matrix(value matrix);
+static void load_matrix(double const *m);
+
+// matrix is a float64 bigarray of 16 values, column major
+static double const *matrix_data(value matrix)
+{
+    struct caml_ba_array *arr = Caml_ba_array_val(matrix);
+    assert(arr->num_dims == 1 && arr->dim[0] == 16);
+    assert((arr->flags & CAML_BA_KIND_MASK) == CAML_BA_FLOAT64);
+    return arr->data;
+}
 
 CAMLprim void gl_set_projection(value matrix)
 {
     CAMLparam1(matrix);
 
     glMatrixMode(GL_PROJECTION);
-    load_matrix(matrix);
+    load_matrix(matrix_data(matrix));
 
     CAMLreturn0;
 }
@@ -338,7 +894,136 @@ CAMLprim void gl_set_modelview(value matrix)
     CAMLparam1(matrix);
 
     glMatrixMode(GL_MODELVIEW);
-    load_matrix(matrix);
+    load_matrix(matrix_data(matrix));
+
+    CAMLreturn0;
+}
+
+/*
+ * Native matrix stacks
+ *
+ * An alternative to the OCaml stacks of Glop_impl.Extension, that push, pop
+ * and multiply matrices in place.
+ */
+
+#define MATRIX_STACK_DEPTH 256
+
+struct matrix_stack {
+    GLenum mode;
+    unsigned top;
+    double m[MATRIX_STACK_DEPTH][16];
+};
+
+// Indexed by the stack number given by OCaml (0 for projection, 1 for modelview)
+static struct matrix_stack matrix_stacks[2] = {
+    { .mode = GL_PROJECTION, .m = { [0] = { 1., 0., 0., 0., 0., 1., 0., 0., 0., 0., 1., 0., 0., 0., 0., 1. } } },
+    { .mode = GL_MODELVIEW,  .m = { [0] = { 1., 0., 0., 0., 0., 1., 0., 0., 0., 0., 1., 0., 0., 0., 0., 1. } } },
+};
+
+// r = a * b, all column major. r must not overlap a or b.
+static void mul_mat4(double *restrict r, double const *restrict a, double const *restrict b)
+{
+#   if defined(__AVX__)
+    __m256d const a0 = _mm256_loadu_pd(a), a1 = _mm256_loadu_pd(a+4),
+                  a2 = _mm256_loadu_pd(a+8), a3 = _mm256_loadu_pd(a+12);
+    for (unsigned c = 0; c < 4; c++) {
+        double const *bc = b + 4*c;
+        __m256d rc = _mm256_mul_pd(a0, _mm256_broadcast_sd(bc));
+        rc = _mm256_add_pd(rc, _mm256_mul_pd(a1, _mm256_broadcast_sd(bc+1)));
+        rc = _mm256_add_pd(rc, _mm256_mul_pd(a2, _mm256_broadcast_sd(bc+2)));
+        rc = _mm256_add_pd(rc, _mm256_mul_pd(a3, _mm256_broadcast_sd(bc+3)));
+        _mm256_storeu_pd(r + 4*c, rc);
+    }
+#   elif defined(__SSE2__)
+    for (unsigned h = 0; h < 4; h += 2) {   // rows h and h+1
+        __m128d const a0 = _mm_loadu_pd(a+h), a1 = _mm_loadu_pd(a+4+h),
+                      a2 = _mm_loadu_pd(a+8+h), a3 = _mm_loadu_pd(a+12+h);
+        for (unsigned c = 0; c < 4; c++) {
+            double const *bc = b + 4*c;
+            __m128d rc = _mm_mul_pd(a0, _mm_set1_pd(bc[0]));
+            rc = _mm_add_pd(rc, _mm_mul_pd(a1, _mm_set1_pd(bc[1])));
+            rc = _mm_add_pd(rc, _mm_mul_pd(a2, _mm_set1_pd(bc[2])));
+            rc = _mm_add_pd(rc, _mm_mul_pd(a3, _mm_set1_pd(bc[3])));
+            _mm_storeu_pd(r + 4*c + h, rc);
+        }
+    }
+#   else
+    for (unsigned c = 0; c < 4; c++) {
+        for (unsigned i = 0; i < 4; i++) {
+            r[4*c + i] = a[i] * b[4*c] + a[4+i] * b[4*c+1] + a[8+i] * b[4*c+2] + a[12+i] * b[4*c+3];
+        }
+    }
+#   endif
+}
+
+static struct matrix_stack *matrix_stack_of(value which)
+{
+    assert(Is_long(which) && Long_val(which) >= 0 && Long_val(which) < (long)sizeof_array(matrix_stacks));
+    return matrix_stacks + Long_val(which);
+}
+
+// Before init, the top of the stack will be uploaded by the next load/pop/mult.
+static void upload_stack_top(struct matrix_stack *stack)
+{
+    if (! inited) return;
+    glMatrixMode(stack->mode);
+    load_matrix(stack->m[stack->top]);
+}
+
+CAMLprim void gl_stack_load(value which, value matrix)
+{
+    CAMLparam2(which, matrix);
+    struct matrix_stack *stack = matrix_stack_of(which);
+
+    memcpy(stack->m[stack->top], matrix_data(matrix), sizeof(stack->m[0]));
+    upload_stack_top(stack);
+
+    CAMLreturn0;
+}
+
+CAMLprim void gl_stack_mult(value which, value matrix)
+{
+    CAMLparam2(which, matrix);
+    struct matrix_stack *stack = matrix_stack_of(which);
+
+    double prev[16];
+    memcpy(prev, stack->m[stack->top], sizeof(prev));
+    mul_mat4(stack->m[stack->top], prev, matrix_data(matrix));
+    upload_stack_top(stack);
+
+    CAMLreturn0;
+}
+
+CAMLprim void gl_stack_push(value which)
+{
+    CAMLparam1(which);
+    struct matrix_stack *stack = matrix_stack_of(which);
+
+    if (stack->top + 1 >= MATRIX_STACK_DEPTH) caml_failwith("Matrix stack overflow");
+    memcpy(stack->m[stack->top + 1], stack->m[stack->top], sizeof(stack->m[0]));
+    stack->top ++;
+
+    CAMLreturn0;
+}
+
+CAMLprim void gl_stack_pop(value which)
+{
+    CAMLparam1(which);
+    struct matrix_stack *stack = matrix_stack_of(which);
+
+    if (stack->top == 0) caml_failwith("Matrix stack underflow");
+    stack->top --;
+    upload_stack_top(stack);
+
+    CAMLreturn0;
+}
+
+CAMLprim void gl_stack_get(value which, value matrix)
+{
+    CAMLparam2(which, matrix);
+    struct matrix_stack *stack = matrix_stack_of(which);
+
+    memcpy((double *)matrix_data(matrix), stack->m[stack->top], sizeof(stack->m[0]));
 
     CAMLreturn0;
 }
@@ -348,7 +1033,7 @@ CAMLprim void gl_set_viewport(value x, value y, value width, value height)
     CAMLparam4(x, y, width, height);
 
     glViewport(Long_val(x), Long_val(y), Long_val(width), Long_val(height));
-    print_error();
+    check_error();
 
     CAMLreturn0;
 }
@@ -359,7 +1044,7 @@ CAMLprim void gl_set_scissor(value x, value y, value width, value height)
 
     glEnable(GL_SCISSOR_TEST);
     glScissor(Long_val(x), Long_val(y), Long_val(width), Long_val(height));
-    print_error();
+    check_error();
 
     CAMLreturn0;
 }
@@ -367,7 +1052,7 @@ CAMLprim void gl_set_scissor(value x, value y, value width, value height)
 CAMLprim void gl_disable_scissor(void)
 {
     glDisable(GL_SCISSOR_TEST);
-    print_error();
+    check_error();
 }
 
 CAMLprim value gl_window_size(void)
@@ -396,3 +1081,1437 @@ static GLenum glmode_of_render_type(int t)
     return modes[t];
 }
 
+
+static GLenum gltype_of_bigarray(struct caml_ba_array const *arr);
+static void set_uniq_color(value color);
+static bool has_uint_indices(void);
+static void multi_draw_arrays(GLenum mode, GLint const *firsts, GLsizei const *counts, GLsizei nb_draws);
+static bool has_framebuffers(void);
+static bool has_float_textures(void);
+static void texcoord1_pointer(float const *values, int nb_values);
+
+// Tells if name is in the space separated list of extensions exts.
+static bool extension_in(char const *exts, char const *name)
+{
+    if (! exts) return false;
+    size_t const len = strlen(name);
+
+    for (char const *e = exts; (e = strstr(e, name)) != NULL; e += len) {
+        if ((e == exts || e[-1] == ' ') && (e[len] == ' ' || e[len] == '\0')) return true;
+    }
+
+    return false;
+}
+
+static bool has_extension(char const *name)
+{
+    return extension_in((char const *)glGetString(GL_EXTENSIONS), name);
+}
+
+// Points GL at the given vertex array and returns the number of vertices.
+static int use_vertex_array(value vertices)
+{
+    CAMLparam1(vertices);
+    assert(Is_block(vertices) && Tag_val(vertices) == Custom_tag);
+
+    struct caml_ba_array *vertices_arr = Caml_ba_array_val(vertices);
+    assert(vertices_arr->num_dims == 2);
+    unsigned const v_dim = vertices_arr->dim[1];
+    assert(v_dim >= 2 && v_dim <= 4);
+    glVertexPointer(v_dim, gltype_of_bigarray(vertices_arr), 0, vertices_arr->data);
+    glEnableClientState(GL_VERTEX_ARRAY);
+
+    CAMLreturnT(int, vertices_arr->dim[0]);
+}
+
+// Points GL at the given colors and returns the number of colors (0 for Uniq).
+static int use_color_specs(value color_specs)
+{
+    CAMLparam1(color_specs);
+    CAMLlocal1(colors);
+    assert(Is_block(color_specs));
+    int nb_colors = 0;
+
+    if (Tag_val(color_specs) == 0) {    // Array
+        colors = Field(color_specs, 0);
+        assert(Is_block(colors) && Tag_val(colors) == Custom_tag);
+        struct caml_ba_array *colors_arr = Caml_ba_array_val(colors);
+        assert(colors_arr->num_dims == 2);
+        unsigned const c_dim = colors_arr->dim[1];
+        assert(c_dim == 3 || c_dim == 4);
+        nb_colors = colors_arr->dim[0];
+        glColorPointer(c_dim, gltype_of_bigarray(colors_arr), 0, colors_arr->data);
+        glEnableClientState(GL_COLOR_ARRAY);
+    } else {
+        assert(Tag_val(color_specs) == 1);
+        set_uniq_color(Field(color_specs, 0));
+        glDisableClientState(GL_COLOR_ARRAY);
+    }
+
+    CAMLreturnT(int, nb_colors);
+}
+
+static int use_texture(value texture_opt);
+static void unuse_texture(value texture_opt);
+
+CAMLprim void gl_render(value texture_opt, value render_type, value vertices, value color_specs)
+{
+    CAMLparam4(texture_opt, render_type, vertices, color_specs);
+    assert(Is_long(render_type));
+
+    int const nb_vertices = use_vertex_array(vertices);
+    int const nb_colors = use_color_specs(color_specs);
+    if (nb_colors > 0) assert(nb_colors == nb_vertices);
+    int const nb_texcoords = use_texture(texture_opt);
+    if (Is_block(texture_opt) && nb_texcoords < nb_vertices) {
+        unuse_texture(texture_opt);
+        caml_invalid_argument("render: not enough texture coordinates");
+    }
+
+    GLenum const mode = glmode_of_render_type(Int_val(render_type));
+    glDrawArrays(mode, 0, nb_vertices);
+    count_draws(1, nb_vertices);
+    unuse_texture(texture_opt);
+
+    check_error();
+    CAMLreturn0;
+}
+
+CAMLprim void gl_render_indexed(value render_type, value vertices, value color_specs, value indices)
+{
+    CAMLparam4(render_type, vertices, color_specs, indices);
+    assert(Is_long(render_type));
+    assert(Is_block(indices));
+
+    int const nb_vertices = use_vertex_array(vertices);
+    int const nb_colors = use_color_specs(color_specs);
+    if (nb_colors > 0) assert(nb_colors == nb_vertices);
+
+    struct caml_ba_array *indices_arr = Caml_ba_array_val(Field(indices, 0));
+    assert(indices_arr->num_dims == 1);
+    intnat const nb_indices = indices_arr->dim[0];
+    GLenum type;
+    // GL would read past the vertex arrays for indices out of range
+    switch (indices_arr->flags & CAML_BA_KIND_MASK) {
+        case CAML_BA_UINT16:
+            type = GL_UNSIGNED_SHORT;
+            for (intnat i = 0; i < nb_indices; i++) {
+                if (((uint16_t const *)indices_arr->data)[i] >= nb_vertices) {
+                    caml_invalid_argument("render_indexed: index out of range");
+                }
+            }
+            break;
+        case CAML_BA_INT32:
+            if (! has_uint_indices()) caml_failwith("render_indexed: 32 bits indices are not supported");
+            type = GL_UNSIGNED_INT;
+            for (intnat i = 0; i < nb_indices; i++) {
+                if (((uint32_t const *)indices_arr->data)[i] >= (uint32_t)nb_vertices) {
+                    caml_invalid_argument("render_indexed: index out of range");
+                }
+            }
+            break;
+        default:
+            assert(!"Bad kind of index array");
+            caml_invalid_argument("render_indexed");
+    }
+
+    GLenum const mode = glmode_of_render_type(Int_val(render_type));
+    glDrawElements(mode, nb_indices, type, indices_arr->data);
+    count_draws(1, nb_indices);
+
+    check_error();
+    CAMLreturn0;
+}
+
+CAMLprim void gl_render_batch(value render_type, value vertices, value color_specs, value firsts, value counts)
+{
+    CAMLparam5(render_type, vertices, color_specs, firsts, counts);
+    assert(Is_long(render_type));
+
+    struct caml_ba_array *firsts_arr = Caml_ba_array_val(firsts);
+    struct caml_ba_array *counts_arr = Caml_ba_array_val(counts);
+    assert(firsts_arr->num_dims == 1 && (firsts_arr->flags & CAML_BA_KIND_MASK) == CAML_BA_INT32);
+    assert(counts_arr->num_dims == 1 && (counts_arr->flags & CAML_BA_KIND_MASK) == CAML_BA_INT32);
+    if (firsts_arr->dim[0] != counts_arr->dim[0]) caml_invalid_argument("render_batch");
+
+    int const nb_vertices = use_vertex_array(vertices);
+    int const nb_colors = use_color_specs(color_specs);
+    if (nb_colors > 0) assert(nb_colors == nb_vertices);
+
+    GLint const *first = firsts_arr->data;
+    GLsizei const *count = counts_arr->data;
+    GLsizei const nb_draws = firsts_arr->dim[0];
+    for (GLsizei d = 0; d < nb_draws; d++) {
+        if (first[d] < 0 || count[d] < 0 ||
+            first[d] > nb_vertices || count[d] > nb_vertices - first[d]) {
+            caml_invalid_argument("render_batch");
+        }
+    }
+
+    GLenum const mode = glmode_of_render_type(Int_val(render_type));
+    multi_draw_arrays(mode, first, count, nb_draws);
+
+    check_error();
+    CAMLreturn0;
+}
+
+// Points GL at both vertices and colors of interleaved rows made of v_dim
+// coordinates followed by c_dim color components.
+static void use_interleaved(GLenum type, size_t elmt_size, unsigned v_dim, unsigned c_dim, char const *data)
+{
+    GLsizei const stride = (v_dim + c_dim) * elmt_size;
+
+    glVertexPointer(v_dim, type, stride, data);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glColorPointer(c_dim, type, stride, data + v_dim * elmt_size);
+    glEnableClientState(GL_COLOR_ARRAY);
+}
+
+CAMLprim void gl_render_interleaved(value v_dim_, value render_type, value interleaved)
+{
+    CAMLparam3(v_dim_, render_type, interleaved);
+    assert(Is_long(render_type));
+    assert(Is_block(interleaved) && Tag_val(interleaved) == Custom_tag);
+
+    struct caml_ba_array *arr = Caml_ba_array_val(interleaved);
+    assert(arr->num_dims == 2);
+    unsigned const v_dim = Long_val(v_dim_);
+    unsigned const c_dim = arr->dim[1] - v_dim;
+    assert(v_dim >= 2 && v_dim <= 4);
+    assert(c_dim == 3 || c_dim == 4);
+
+    use_interleaved(gltype_of_bigarray(arr), caml_ba_element_size[arr->flags & CAML_BA_KIND_MASK],
+                    v_dim, c_dim, arr->data);
+
+    GLenum const mode = glmode_of_render_type(Int_val(render_type));
+    glDrawArrays(mode, 0, arr->dim[0]);
+    count_draws(1, arr->dim[0]);
+
+    check_error();
+    CAMLreturn0;
+}
+
+/*
+ * Instanced rendering
+ *
+ * Backends with per-instance attributes draw all instances from the shape
+ * alone. The fixed pipeline has none, so there instances are expanded on the
+ * CPU into a single batch of floats and drawn in one call.
+ */
+
+// Draws one copy of shape per row of offsets (and scales, if not NULL) with
+// the colors of color_specs, one per instance if an Array. Returns false if
+// the backend cannot, so that instances are expanded instead.
+static bool draw_instanced(GLenum mode, value shape, struct caml_ba_array const *offsets, struct caml_ba_array const *scales, value color_specs);
+
+// Reads any element of a geometry bigarray as a float
+static float ba_float(struct caml_ba_array const *arr, size_t i)
+{
+    switch (arr->flags & CAML_BA_KIND_MASK) {
+        case CAML_BA_FLOAT64:
+            return ((double const *)arr->data)[i];
+        case CAML_BA_FLOAT32:
+            return ((float const *)arr->data)[i];
+        default:    // 16.16 fixed point
+            assert((arr->flags & CAML_BA_KIND_MASK) == CAML_BA_NATIVE_INT);
+            return ((intnat const *)arr->data)[i] / 65536.f;
+    }
+}
+
+struct scratch {
+    void *data;
+    size_t size;
+};
+
+static void *scratch_alloc(struct scratch *scratch, size_t size)
+{
+    if (size > scratch->size) {
+        void *new_data = realloc(scratch->data, size);
+        if (! new_data) caml_raise_out_of_memory();
+        scratch->data = new_data;
+        scratch->size = size;
+    }
+    return scratch->data;
+}
+
+static struct scratch instance_vertices, instance_colors, instance_ranges;
+
+CAMLprim void gl_render_instanced(value scales_opt, value render_type, value shape, value offsets, value color_specs)
+{
+    CAMLparam5(scales_opt, render_type, shape, offsets, color_specs);
+    assert(Is_long(render_type));
+
+    struct caml_ba_array *shape_arr = Caml_ba_array_val(shape);
+    struct caml_ba_array *offsets_arr = Caml_ba_array_val(offsets);
+    struct caml_ba_array *scales_arr = Is_block(scales_opt) ? Caml_ba_array_val(Field(scales_opt, 0)) : NULL;
+    assert(shape_arr->num_dims == 2 && offsets_arr->num_dims == 2);
+    unsigned const v_dim = shape_arr->dim[1];
+    assert(v_dim >= 2 && v_dim <= 4 && (unsigned)offsets_arr->dim[1] == v_dim);
+    int const nb_shape = shape_arr->dim[0];
+    int const nb_instances = offsets_arr->dim[0];
+    if (scales_arr && (scales_arr->dim[0] != nb_instances || (unsigned)scales_arr->dim[1] != v_dim)) {
+        caml_invalid_argument("render_instanced: bad scales");
+    }
+    assert(Is_block(color_specs));
+    struct caml_ba_array *colors_arr = NULL;
+    if (Tag_val(color_specs) == 0) {    // Array, one color per instance
+        colors_arr = Caml_ba_array_val(Field(color_specs, 0));
+        assert(colors_arr->num_dims == 2);
+        assert(colors_arr->dim[1] == 3 || colors_arr->dim[1] == 4);
+        if (colors_arr->dim[0] != nb_instances) caml_invalid_argument("render_instanced: bad colors");
+    }
+    if (nb_shape == 0 || nb_instances == 0) CAMLreturn0;
+
+    GLenum const mode = glmode_of_render_type(Int_val(render_type));
+    if (draw_instanced(mode, shape, offsets_arr, scales_arr, color_specs)) {
+        check_error();
+        CAMLreturn0;
+    }
+
+    size_t const nb_vertices = (size_t)nb_shape * nb_instances;
+
+    float *vertices = scratch_alloc(&instance_vertices, nb_vertices * v_dim * sizeof(*vertices));
+    for (int i = 0; i < nb_instances; i++) {
+        for (int v = 0; v < nb_shape; v++) {
+            float *out = vertices + ((size_t)i * nb_shape + v) * v_dim;
+            for (unsigned d = 0; d < v_dim; d++) {
+                float const scale = scales_arr ? ba_float(scales_arr, i * v_dim + d) : 1.f;
+                out[d] = ba_float(shape_arr, v * v_dim + d) * scale + ba_float(offsets_arr, i * v_dim + d);
+            }
+        }
+    }
+    glVertexPointer(v_dim, GL_FLOAT, 0, vertices);
+    glEnableClientState(GL_VERTEX_ARRAY);
+
+    if (colors_arr) {
+        unsigned const c_dim = colors_arr->dim[1];
+        float *colors = scratch_alloc(&instance_colors, nb_vertices * c_dim * sizeof(*colors));
+        for (int i = 0; i < nb_instances; i++) {
+            for (unsigned c = 0; c < c_dim; c++) {
+                colors[(size_t)i * nb_shape * c_dim + c] = ba_float(colors_arr, i * c_dim + c);
+            }
+            for (int v = 1; v < nb_shape; v++) {
+                memcpy(colors + ((size_t)i * nb_shape + v) * c_dim,
+                       colors + (size_t)i * nb_shape * c_dim, c_dim * sizeof(*colors));
+            }
+        }
+        glColorPointer(c_dim, GL_FLOAT, 0, colors);
+        glEnableClientState(GL_COLOR_ARRAY);
+    } else {
+        set_uniq_color(Field(color_specs, 0));
+        glDisableClientState(GL_COLOR_ARRAY);
+    }
+
+    if (mode == GL_POINTS || mode == GL_LINES || mode == GL_TRIANGLES) {
+        // Instances do not need to be separated
+        glDrawArrays(mode, 0, nb_vertices);
+        count_draws(1, nb_vertices);
+    } else {
+        GLint *ranges = scratch_alloc(&instance_ranges, 2 * nb_instances * sizeof(*ranges));
+        GLint *firsts = ranges;
+        GLsizei *counts = (GLsizei *)ranges + nb_instances;
+        for (int i = 0; i < nb_instances; i++) {
+            firsts[i] = i * nb_shape;
+            counts[i] = nb_shape;
+        }
+        multi_draw_arrays(mode, firsts, counts, nb_instances);
+    }
+
+    check_error();
+    CAMLreturn0;
+}
+
+/*
+ * Deferred deletion of GL objects
+ *
+ * Finalizers may run in any thread, while GL objects can only be deleted
+ * by the thread owning the GL context. So finalizers merely record the
+ * names of the dead objects, which are deleted on the next occasion.
+ */
+
+struct dead_object {
+    void (*delete)(GLsizei, GLuint const *);    // NULL for a fence
+    GLuint name;
+#   ifdef GL_SYNC_GPU_COMMANDS_COMPLETE
+    GLsync sync;    // fences have no name
+#   endif
+};
+
+static struct dead_object *dead_objects;
+static unsigned nb_dead_objects, max_dead_objects;
+
+// Returns a new entry in the list of dead objects, or NULL.
+static struct dead_object *new_dead_object(void)
+{
+    if (nb_dead_objects >= max_dead_objects) {
+        unsigned const new_max = max_dead_objects ? 2 * max_dead_objects : 64;
+        struct dead_object *new_objs = realloc(dead_objects, new_max * sizeof(*new_objs));
+        if (! new_objs) return NULL;
+        dead_objects = new_objs;
+        max_dead_objects = new_max;
+    }
+
+    return dead_objects + nb_dead_objects ++;
+}
+
+static void defer_delete(void (*delete)(GLsizei, GLuint const *), GLuint name)
+{
+    if (name == 0) return;
+
+    struct dead_object *obj = new_dead_object();
+    if (! obj) {
+        fprintf(stderr, "Cannot allocate list of dead GL objects, leaking %u\n", name);
+        return;
+    }
+    obj->delete = delete;
+    obj->name = name;
+}
+
+#ifdef GL_SYNC_GPU_COMMANDS_COMPLETE
+static void defer_delete_sync(GLsync sync)
+{
+    if (! sync) return;
+
+    struct dead_object *obj = new_dead_object();
+    if (! obj) {
+        fprintf(stderr, "Cannot allocate list of dead GL objects, leaking a fence\n");
+        return;
+    }
+    obj->delete = NULL;
+    obj->sync = sync;
+}
+#endif
+
+static void delete_dead_objects(void)
+{
+    for (unsigned o = 0; o < nb_dead_objects; o++) {
+#       ifdef GL_SYNC_GPU_COMMANDS_COMPLETE
+        if (! dead_objects[o].delete) {
+            glDeleteSync(dead_objects[o].sync);
+            continue;
+        }
+#       endif
+        dead_objects[o].delete(1, &dead_objects[o].name);
+    }
+    nb_dead_objects = 0;
+}
+
+/*
+ * Buffer objects
+ */
+
+struct buffer {
+    GLuint vertices, colors;    // GL buffer names (0 if none/released)
+    GLenum v_type, c_type;
+    unsigned v_dim, c_dim;
+    int nb_vertices;
+    // If interleaved, colors are stored in the vertices buffer after each vertex
+    bool interleaved;
+    size_t elmt_size;   // only used for interleaved buffers
+};
+
+#define Buffer_val(v) ((struct buffer *)Data_custom_val(v))
+
+static void finalize_buffer(value buffer)
+{
+    struct buffer *buf = Buffer_val(buffer);
+    defer_delete(glDeleteBuffers, buf->vertices);
+    defer_delete(glDeleteBuffers, buf->colors);
+}
+
+static struct custom_operations buffer_ops = {
+    .identifier = "glop.buffer",
+    .finalize = finalize_buffer,
+    .compare = custom_compare_default,
+    .hash = custom_hash_default,
+    .serialize = custom_serialize_default,
+    .deserialize = custom_deserialize_default,
+    .compare_ext = custom_compare_ext_default,
+};
+
+// Raises if arr_ cannot be written into the rows starting at first of a
+// buffer of nb_rows rows of the given type and dim.
+static void check_update(value arr_, int first, int nb_rows, GLenum type, unsigned dim)
+{
+    struct caml_ba_array *arr = Caml_ba_array_val(arr_);
+    assert(arr->num_dims == 2);
+    if (gltype_of_bigarray(arr) != type || (unsigned)arr->dim[1] != dim ||
+        first > nb_rows || arr->dim[0] > nb_rows - first) {
+        caml_invalid_argument("update_buffer");
+    }
+}
+
+// Uploads the whole array arr_ (resizing the buffer) or, if first >= 0,
+// only into the rows starting at first. Returns the number of rows.
+static int upload_array(GLuint name, value arr_, int first, int nb_rows, GLenum *type, unsigned *dim)
+{
+    CAMLparam1(arr_);
+    assert(Is_block(arr_) && Tag_val(arr_) == Custom_tag);
+
+    struct caml_ba_array *arr = Caml_ba_array_val(arr_);
+    assert(arr->num_dims == 2);
+    size_t const elmt_size = caml_ba_element_size[arr->flags & CAML_BA_KIND_MASK];
+    size_t const row_size = arr->dim[1] * elmt_size;
+
+    if (first >= 0) check_update(arr_, first, nb_rows, *type, *dim);
+
+    glBindBuffer(GL_ARRAY_BUFFER, name);
+    if (first < 0) {
+        *type = gltype_of_bigarray(arr);
+        *dim = arr->dim[1];
+        glBufferData(GL_ARRAY_BUFFER, arr->dim[0] * row_size, arr->data, GL_STATIC_DRAW);
+    } else {
+        glBufferSubData(GL_ARRAY_BUFFER, first * row_size, arr->dim[0] * row_size, arr->data);
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    CAMLreturnT(int, arr->dim[0]);
+}
+
+CAMLprim value gl_make_buffer(value colors_opt, value vertices)
+{
+    CAMLparam2(colors_opt, vertices);
+    CAMLlocal1(buffer);
+
+    delete_dead_objects();
+
+    buffer = caml_alloc_custom(&buffer_ops, sizeof(struct buffer), 0, 1);
+    struct buffer *buf = Buffer_val(buffer);
+    memset(buf, 0, sizeof(*buf));
+
+    glGenBuffers(1, &buf->vertices);
+    buf->nb_vertices = upload_array(buf->vertices, vertices, -1, 0, &buf->v_type, &buf->v_dim);
+
+    if (Is_block(colors_opt)) {
+        glGenBuffers(1, &buf->colors);
+        int const nb_colors = upload_array(buf->colors, Field(colors_opt, 0), -1, 0, &buf->c_type, &buf->c_dim);
+        if (nb_colors != buf->nb_vertices) caml_invalid_argument("make_buffer");
+    }
+
+    check_error();
+    CAMLreturn(buffer);
+}
+
+CAMLprim value gl_make_interleaved_buffer(value v_dim, value interleaved)
+{
+    CAMLparam2(v_dim, interleaved);
+    CAMLlocal1(buffer);
+
+    delete_dead_objects();
+
+    buffer = caml_alloc_custom(&buffer_ops, sizeof(struct buffer), 0, 1);
+    struct buffer *buf = Buffer_val(buffer);
+    memset(buf, 0, sizeof(*buf));
+    buf->interleaved = true;
+
+    unsigned width;
+    glGenBuffers(1, &buf->vertices);
+    buf->nb_vertices = upload_array(buf->vertices, interleaved, -1, 0, &buf->v_type, &width);
+    buf->c_type = buf->v_type;
+    struct caml_ba_array *arr = Caml_ba_array_val(interleaved);
+    buf->elmt_size = caml_ba_element_size[arr->flags & CAML_BA_KIND_MASK];
+    buf->v_dim = Long_val(v_dim);
+    buf->c_dim = width - buf->v_dim;
+    assert(buf->c_dim == 3 || buf->c_dim == 4);
+
+    check_error();
+    CAMLreturn(buffer);
+}
+
+CAMLprim void gl_update_interleaved_buffer(value first_opt, value buffer, value interleaved)
+{
+    CAMLparam3(first_opt, buffer, interleaved);
+    struct buffer *buf = Buffer_val(buffer);
+    if (! buf->vertices) caml_invalid_argument("update_interleaved_buffer: buffer was released");
+    if (! buf->interleaved) caml_invalid_argument("update_interleaved_buffer: buffer is not interleaved");
+
+    int const first = Is_block(first_opt) ? Long_val(Field(first_opt, 0)) : -1;
+    if (Is_block(first_opt) && first < 0) caml_invalid_argument("update_interleaved_buffer");
+
+    unsigned width = buf->v_dim + buf->c_dim;
+    int const nb_vertices = upload_array(buf->vertices, interleaved, first, buf->nb_vertices, &buf->v_type, &width);
+    if (first < 0) buf->nb_vertices = nb_vertices;
+    assert(width == buf->v_dim + buf->c_dim);
+    buf->c_type = buf->v_type;
+
+    check_error();
+    CAMLreturn0;
+}
+
+CAMLprim void gl_update_buffer(value first_opt, value colors_opt, value buffer, value vertices)
+{
+    CAMLparam4(first_opt, colors_opt, buffer, vertices);
+    struct buffer *buf = Buffer_val(buffer);
+    if (! buf->vertices) caml_invalid_argument("update_buffer: buffer was released");
+    if (buf->interleaved) caml_invalid_argument("update_buffer: buffer is interleaved");
+
+    int const first = Is_block(first_opt) ? Long_val(Field(first_opt, 0)) : -1;
+    if (Is_block(first_opt) && first < 0) caml_invalid_argument("update_buffer");
+
+    // Check everything before uploading anything, so that the buffer is left
+    // untouched on error
+    if (Is_block(colors_opt)) {
+        value const colors = Field(colors_opt, 0);
+        if (Caml_ba_array_val(colors)->dim[0] != Caml_ba_array_val(vertices)->dim[0]) {
+            caml_invalid_argument("update_buffer");
+        }
+        if (first >= 0) {
+            if (! buf->colors) caml_invalid_argument("update_buffer: buffer has no colors");
+            check_update(colors, first, buf->nb_vertices, buf->c_type, buf->c_dim);
+        }
+    }
+
+    int const nb_vertices = upload_array(buf->vertices, vertices, first, buf->nb_vertices, &buf->v_type, &buf->v_dim);
+
+    if (Is_block(colors_opt)) {
+        if (! buf->colors) glGenBuffers(1, &buf->colors);
+        upload_array(buf->colors, Field(colors_opt, 0), first, buf->nb_vertices, &buf->c_type, &buf->c_dim);
+    } else if (first < 0 && buf->colors) {
+        // The previous colors do not match the new vertices
+        glDeleteBuffers(1, &buf->colors);
+        buf->colors = 0;
+    }
+    if (first < 0) buf->nb_vertices = nb_vertices;
+
+    check_error();
+    CAMLreturn0;
+}
+
+CAMLprim void gl_render_buffer(value color_opt, value render_type, value buffer)
+{
+    CAMLparam3(color_opt, render_type, buffer);
+    assert(Is_long(render_type));
+    struct buffer *buf = Buffer_val(buffer);
+    if (! buf->vertices) caml_invalid_argument("render_buffer: buffer was released");
+
+    glBindBuffer(GL_ARRAY_BUFFER, buf->vertices);
+    if (buf->interleaved) {
+        use_interleaved(buf->v_type, buf->elmt_size, buf->v_dim, buf->c_dim, NULL);
+    } else {
+        glVertexPointer(buf->v_dim, buf->v_type, 0, NULL);
+        glEnableClientState(GL_VERTEX_ARRAY);
+    }
+
+    if (Is_block(color_opt)) {
+        set_uniq_color(Field(color_opt, 0));
+        glDisableClientState(GL_COLOR_ARRAY);
+    } else if (buf->interleaved) {
+        // already set above
+    } else if (buf->colors) {
+        glBindBuffer(GL_ARRAY_BUFFER, buf->colors);
+        glColorPointer(buf->c_dim, buf->c_type, 0, NULL);
+        glEnableClientState(GL_COLOR_ARRAY);
+    } else {
+        glDisableClientState(GL_COLOR_ARRAY);
+    }
+    // Pointers are bound to the buffer at the time they are set:
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    GLenum const mode = glmode_of_render_type(Int_val(render_type));
+    glDrawArrays(mode, 0, buf->nb_vertices);
+    count_draws(1, buf->nb_vertices);
+
+    check_error();
+    CAMLreturn0;
+}
+
+CAMLprim void gl_release_buffer(value buffer)
+{
+    CAMLparam1(buffer);
+    struct buffer *buf = Buffer_val(buffer);
+
+    delete_dead_objects();
+    if (buf->vertices) glDeleteBuffers(1, &buf->vertices);
+    if (buf->colors) glDeleteBuffers(1, &buf->colors);
+    buf->vertices = buf->colors = 0;
+
+    check_error();
+    CAMLreturn0;
+}
+
+/*
+ * Streaming buffers
+ *
+ * A buffer object split into depth regions that are written in turn. The
+ * vertices are written into an OCaml vertex array that the stream keeps, and
+ * copied at render time into the next region, mapped unsynchronized. A fence
+ * is set after each region is rendered, and waited for before that region is
+ * mapped again, which depth frames later should not wait at all.
+ * Without fences (GLES 1), the single region is orphaned before each copy.
+ */
+
+#define MAX_STREAM_DEPTH 8
+
+#ifndef GL_STREAM_DRAW
+#   define GL_STREAM_DRAW GL_DYNAMIC_DRAW  // GLES 1
+#endif
+
+// Fences are only in GL >= 3.2 and GLES 3
+#ifdef GL_SYNC_GPU_COMMANDS_COMPLETE
+static bool has_fences(void);
+#endif
+
+struct stream {
+    GLuint name;        // 0 once released
+    int kind;           // of the vertex array
+    GLenum type;
+    unsigned v_dim;
+    int nb_vertices;    // per region
+    size_t region_size;
+    unsigned depth, next;
+#   ifdef GL_SYNC_GPU_COMMANDS_COMPLETE
+    GLsync fences[MAX_STREAM_DEPTH];
+#   endif
+};
+
+#define Stream_val(v) ((struct stream *)Data_custom_val(v))
+
+static void finalize_stream(value stream)
+{
+    struct stream *str = Stream_val(stream);
+    defer_delete(glDeleteBuffers, str->name);
+#   ifdef GL_SYNC_GPU_COMMANDS_COMPLETE
+    for (unsigned f = 0; f < str->depth; f++) defer_delete_sync(str->fences[f]);
+#   endif
+}
+
+static struct custom_operations stream_ops = {
+    .identifier = "glop.stream",
+    .finalize = finalize_stream,
+    .compare = custom_compare_default,
+    .hash = custom_hash_default,
+    .serialize = custom_serialize_default,
+    .deserialize = custom_deserialize_default,
+    .compare_ext = custom_compare_ext_default,
+};
+
+// The vertex array the stream will be rendered from gives the kind, the
+// dimension and the number of vertices per region.
+CAMLprim value gl_make_stream(value depth_opt, value vertices)
+{
+    CAMLparam2(depth_opt, vertices);
+    CAMLlocal1(stream);
+
+    unsigned const depth = Is_block(depth_opt) ? Long_val(Field(depth_opt, 0)) : 3;
+    if (depth < 1 || depth > MAX_STREAM_DEPTH) caml_invalid_argument("make_stream: bad depth");
+
+    struct caml_ba_array *arr = Caml_ba_array_val(vertices);
+    assert(arr->num_dims == 2);
+    if (arr->dim[0] <= 0 || arr->dim[0] > INT_MAX) caml_invalid_argument("make_stream: bad size");
+
+    delete_dead_objects();
+
+    stream = caml_alloc_custom(&stream_ops, sizeof(struct stream), 0, 1);
+    struct stream *str = Stream_val(stream);
+    memset(str, 0, sizeof(*str));
+    str->kind = arr->flags & CAML_BA_KIND_MASK;
+    str->type = gltype_of_bigarray(arr);
+    str->v_dim = arr->dim[1];
+    str->nb_vertices = arr->dim[0];
+    str->region_size = caml_ba_byte_size(arr);
+    str->depth = 1;
+#   ifdef GL_SYNC_GPU_COMMANDS_COMPLETE
+    if (has_fences()) str->depth = depth;
+#   endif
+
+    glGenBuffers(1, &str->name);
+    glBindBuffer(GL_ARRAY_BUFFER, str->name);
+    glBufferData(GL_ARRAY_BUFFER, str->depth * str->region_size, NULL, GL_STREAM_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    check_error();
+    CAMLreturn(stream);
+}
+
+CAMLprim void gl_render_stream(value count_opt, value color_opt, value render_type, value stream, value vertices)
+{
+    CAMLparam5(count_opt, color_opt, render_type, stream, vertices);
+    assert(Is_long(render_type));
+    struct stream *str = Stream_val(stream);
+    if (! str->name) caml_invalid_argument("render_stream: stream was released");
+
+    struct caml_ba_array *arr = Caml_ba_array_val(vertices);
+    assert(arr->num_dims == 2);
+    assert((arr->flags & CAML_BA_KIND_MASK) == str->kind);
+    assert(arr->dim[0] == str->nb_vertices && (unsigned)arr->dim[1] == str->v_dim);
+
+    int const count = Is_block(count_opt) ? Long_val(Field(count_opt, 0)) : str->nb_vertices;
+    if (count < 0 || count > str->nb_vertices) caml_invalid_argument("render_stream: bad count");
+    size_t const size = count * (str->region_size / str->nb_vertices);
+    size_t const offset = str->next * str->region_size;
+
+    glBindBuffer(GL_ARRAY_BUFFER, str->name);
+#   ifdef GL_SYNC_GPU_COMMANDS_COMPLETE
+    GLsync *fence = str->fences + str->next;
+    if (*fence) {
+        // Should be signaled already, unless the GPU is depth frames late
+        caml_release_runtime_system();
+        while (GL_TIMEOUT_EXPIRED == glClientWaitSync(*fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000)) ;
+        caml_acquire_runtime_system();
+        glDeleteSync(*fence);
+        *fence = 0;
+    }
+#   endif
+    bool mapped = false;
+#   ifdef GL_SYNC_GPU_COMMANDS_COMPLETE
+    if (str->depth > 1 && size > 0) {
+        // The GPU is done with this region, so there is nothing to sync with
+        void *region = glMapBufferRange(GL_ARRAY_BUFFER, offset, size,
+            GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT | GL_MAP_INVALIDATE_RANGE_BIT);
+        if (region) {
+            memcpy(region, arr->data, size);
+            mapped = glUnmapBuffer(GL_ARRAY_BUFFER);
+        }
+    }
+#   endif
+    if (! mapped) {
+        if (str->depth == 1) {
+            // Orphan the buffer so that the GPU can still read the previous one
+            glBufferData(GL_ARRAY_BUFFER, str->region_size, NULL, GL_STREAM_DRAW);
+        }
+        glBufferSubData(GL_ARRAY_BUFFER, offset, size, arr->data);
+    }
+    glVertexPointer(str->v_dim, str->type, 0, (void const *)offset);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    if (Is_block(color_opt)) set_uniq_color(Field(color_opt, 0));
+    glDisableClientState(GL_COLOR_ARRAY);
+
+    GLenum const mode = glmode_of_render_type(Int_val(render_type));
+    glDrawArrays(mode, 0, count);
+    count_draws(1, count);
+
+#   ifdef GL_SYNC_GPU_COMMANDS_COMPLETE
+    if (str->depth > 1) *fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+#   endif
+    str->next = (str->next + 1) % str->depth;
+
+    check_error();
+    CAMLreturn0;
+}
+
+CAMLprim void gl_release_stream(value stream)
+{
+    CAMLparam1(stream);
+    struct stream *str = Stream_val(stream);
+
+    delete_dead_objects();
+    if (str->name) glDeleteBuffers(1, &str->name);
+    str->name = 0;
+#   ifdef GL_SYNC_GPU_COMMANDS_COMPLETE
+    for (unsigned f = 0; f < str->depth; f++) {
+        if (str->fences[f]) glDeleteSync(str->fences[f]);
+        str->fences[f] = 0;
+    }
+#   endif
+
+    check_error();
+    CAMLreturn0;
+}
+
+/*
+ * Reading pixels back
+ */
+
+// Size in bytes of width x height RGBA pixels, that GL must be able to read.
+static size_t pixels_size(intnat width, intnat height, char const *what)
+{
+    if (width < 0 || height < 0 || width > INT_MAX || height > INT_MAX ||
+        (height > 0 && (size_t)width > SIZE_MAX / 4 / (size_t)height)) {
+        caml_invalid_argument(what);
+    }
+    return 4 * (size_t)width * (size_t)height;
+}
+
+static unsigned char *pixels_data(value pixels, intnat width, intnat height)
+{
+    struct caml_ba_array *arr = Caml_ba_array_val(pixels);
+    assert(arr->num_dims == 1);
+    assert((arr->flags & CAML_BA_KIND_MASK) == CAML_BA_UINT8);
+    if ((size_t)arr->dim[0] < pixels_size(width, height, "read_pixels: bad size")) {
+        caml_invalid_argument("read_pixels: bad size");
+    }
+    return arr->data;
+}
+
+CAMLprim void gl_read_pixels(value x, value y, value width, value height, value pixels)
+{
+    CAMLparam5(x, y, width, height, pixels);
+
+    unsigned char *data = pixels_data(pixels, Long_val(width), Long_val(height));
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(Long_val(x), Long_val(y), Long_val(width), Long_val(height), GL_RGBA, GL_UNSIGNED_BYTE, data);
+
+    check_error();
+    CAMLreturn0;
+}
+
+#define MAX_PIXEL_READER_DEPTH 8
+
+// A ring of pixel buffer objects. Without them (GLES 1) reads are synchronous.
+struct pixel_reader {
+    int width, height;
+    unsigned depth;         // Number of frames in flight
+    unsigned next;          // Next PBO to read the frame into
+    unsigned nb_pending;    // Number of frames read but not copied yet
+    GLuint pbos[MAX_PIXEL_READER_DEPTH];   // 0 once released
+};
+
+#define Pixel_reader_val(v) ((struct pixel_reader *)Data_custom_val(v))
+
+static void finalize_pixel_reader(value reader)
+{
+#   ifdef GL_PIXEL_PACK_BUFFER
+    struct pixel_reader *rdr = Pixel_reader_val(reader);
+    for (unsigned p = 0; p < rdr->depth; p++) {
+        defer_delete(glDeleteBuffers, rdr->pbos[p]);
+    }
+#   else
+    (void)reader;
+#   endif
+}
+
+static struct custom_operations pixel_reader_ops = {
+    .identifier = "glop.pixel_reader",
+    .finalize = finalize_pixel_reader,
+    .compare = custom_compare_default,
+    .hash = custom_hash_default,
+    .serialize = custom_serialize_default,
+    .deserialize = custom_deserialize_default,
+    .compare_ext = custom_compare_ext_default,
+};
+
+CAMLprim value gl_make_pixel_reader(value depth_opt, value width, value height)
+{
+    CAMLparam3(depth_opt, width, height);
+    CAMLlocal1(reader);
+
+    unsigned const depth = Is_block(depth_opt) ? Long_val(Field(depth_opt, 0)) : 3;
+    if (depth < 1 || depth > MAX_PIXEL_READER_DEPTH) caml_invalid_argument("make_pixel_reader: bad depth");
+    if (Long_val(width) <= 0 || Long_val(height) <= 0) caml_invalid_argument("make_pixel_reader: bad size");
+    pixels_size(Long_val(width), Long_val(height), "make_pixel_reader: bad size");
+
+    delete_dead_objects();
+
+    reader = caml_alloc_custom(&pixel_reader_ops, sizeof(struct pixel_reader), 0, 1);
+    struct pixel_reader *rdr = Pixel_reader_val(reader);
+    memset(rdr, 0, sizeof(*rdr));
+    rdr->width = Long_val(width);
+    rdr->height = Long_val(height);
+    rdr->depth = depth;
+
+#   ifdef GL_PIXEL_PACK_BUFFER
+    glGenBuffers(depth, rdr->pbos);
+    for (unsigned p = 0; p < depth; p++) {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, rdr->pbos[p]);
+        glBufferData(GL_PIXEL_PACK_BUFFER, pixels_size(rdr->width, rdr->height, NULL), NULL, GL_STREAM_READ);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+#   endif
+
+    check_error();
+    CAMLreturn(reader);
+}
+
+CAMLprim value gl_read_pixels_async(value reader, value pixels)
+{
+    CAMLparam2(reader, pixels);
+    struct pixel_reader *rdr = Pixel_reader_val(reader);
+    unsigned char *data = pixels_data(pixels, rdr->width, rdr->height);
+    bool copied = false;
+
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+
+#   ifdef GL_PIXEL_PACK_BUFFER
+    if (! rdr->pbos[0]) caml_invalid_argument("read_pixels_async: reader was released");
+
+    // Start reading the current frame into the next PBO...
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, rdr->pbos[rdr->next]);
+    glReadPixels(0, 0, rdr->width, rdr->height, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    rdr->next = (rdr->next + 1) % rdr->depth;
+    rdr->nb_pending ++;
+
+    // ...and copy the oldest one, that the GPU had depth-1 frames to complete
+    if (rdr->nb_pending >= rdr->depth) {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, rdr->pbos[rdr->next]);
+        void const *mapped = glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+        if (mapped) {
+            memcpy(data, mapped, pixels_size(rdr->width, rdr->height, NULL));
+            glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+            copied = true;
+        }
+        rdr->nb_pending --;
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+#   else
+    glReadPixels(0, 0, rdr->width, rdr->height, GL_RGBA, GL_UNSIGNED_BYTE, data);
+    copied = true;
+#   endif
+
+    check_error();
+    CAMLreturn(Val_bool(copied));
+}
+
+CAMLprim void gl_release_pixel_reader(value reader)
+{
+    CAMLparam1(reader);
+
+#   ifdef GL_PIXEL_PACK_BUFFER
+    struct pixel_reader *rdr = Pixel_reader_val(reader);
+    delete_dead_objects();
+    if (rdr->pbos[0]) glDeleteBuffers(rdr->depth, rdr->pbos);
+    memset(rdr->pbos, 0, sizeof(rdr->pbos));
+    check_error();
+#   else
+    (void)reader;
+#   endif
+
+    CAMLreturn0;
+}
+
+/*
+ * Render targets
+ *
+ * A framebuffer object which color buffer is a texture (so that it can be
+ * composited into another target), with an optional depth renderbuffer.
+ */
+
+struct render_target {
+    GLuint fbo, texture, depth;  // GL names (0 if none/released)
+    int width, height;
+};
+
+#define Render_target_val(v) ((struct render_target *)Data_custom_val(v))
+
+static void finalize_render_target(value target)
+{
+    struct render_target *tgt = Render_target_val(target);
+    defer_delete(glDeleteFramebuffers, tgt->fbo);
+    defer_delete(glDeleteTextures, tgt->texture);
+    defer_delete(glDeleteRenderbuffers, tgt->depth);
+}
+
+static struct custom_operations render_target_ops = {
+    .identifier = "glop.render_target",
+    .finalize = finalize_render_target,
+    .compare = custom_compare_default,
+    .hash = custom_hash_default,
+    .serialize = custom_serialize_default,
+    .deserialize = custom_deserialize_default,
+    .compare_ext = custom_compare_ext_default,
+};
+
+// (Re)allocates the storage of the attachments. Leaves the FBO bound.
+static void alloc_render_target(struct render_target *tgt, int width, int height)
+{
+    if (width <= 0 || height <= 0) caml_invalid_argument("render target: bad size");
+    tgt->width = width;
+    tgt->height = height;
+
+    glBindTexture(GL_TEXTURE_2D, tgt->texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, tgt->fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, tgt->texture, 0);
+
+    if (tgt->depth) {
+        glBindRenderbuffer(GL_RENDERBUFFER, tgt->depth);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT16, width, height);
+        glBindRenderbuffer(GL_RENDERBUFFER, 0);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, tgt->depth);
+    }
+
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        caml_failwith("render target: incomplete framebuffer");
+    }
+}
+
+CAMLprim value gl_make_render_target(value depth_opt, value width, value height)
+{
+    CAMLparam3(depth_opt, width, height);
+    CAMLlocal1(target);
+
+    if (! has_framebuffers()) caml_failwith("make_render_target: no framebuffer objects");
+
+    delete_dead_objects();
+
+    target = caml_alloc_custom(&render_target_ops, sizeof(struct render_target), 0, 1);
+    struct render_target *tgt = Render_target_val(target);
+    memset(tgt, 0, sizeof(*tgt));
+
+    glGenFramebuffers(1, &tgt->fbo);
+    glGenTextures(1, &tgt->texture);
+    glBindTexture(GL_TEXTURE_2D, tgt->texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    if (Is_block(depth_opt) && Bool_val(Field(depth_opt, 0))) {
+        glGenRenderbuffers(1, &tgt->depth);
+    }
+
+    alloc_render_target(tgt, Long_val(width), Long_val(height));
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    check_error();
+    CAMLreturn(target);
+}
+
+CAMLprim void gl_resize_render_target(value target, value width, value height)
+{
+    CAMLparam3(target, width, height);
+    struct render_target *tgt = Render_target_val(target);
+    if (! tgt->fbo) caml_invalid_argument("resize_render_target: target was released");
+
+    GLint bound;
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &bound);
+    alloc_render_target(tgt, Long_val(width), Long_val(height));
+    glBindFramebuffer(GL_FRAMEBUFFER, bound);
+
+    check_error();
+    CAMLreturn0;
+}
+
+CAMLprim value gl_render_target_size(value target)
+{
+    CAMLparam1(target);
+    CAMLlocal1(size);
+    struct render_target *tgt = Render_target_val(target);
+
+    size = caml_alloc_tuple(2);
+    Store_field(size, 0, Val_long(tgt->width));
+    Store_field(size, 1, Val_long(tgt->height));
+
+    CAMLreturn(size);
+}
+
+CAMLprim void gl_bind_render_target(value target_opt)
+{
+    CAMLparam1(target_opt);
+
+    GLuint fbo = 0;   // the window (or pbuffer)
+    if (Is_block(target_opt)) {
+        struct render_target *tgt = Render_target_val(Field(target_opt, 0));
+        if (! tgt->fbo) caml_invalid_argument("bind_render_target: target was released");
+        fbo = tgt->fbo;
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+
+    check_error();
+    CAMLreturn0;
+}
+
+CAMLprim void gl_composite_render_target(value target)
+{
+    CAMLparam1(target);
+    struct render_target *tgt = Render_target_val(target);
+    if (! tgt->texture) caml_invalid_argument("composite_render_target: target was released");
+
+    static GLfloat const corners[] = { -1, -1,  1, -1,  1, 1,  -1, 1 };
+    static GLfloat const texcoords[] = { 0, 0,  1, 0,  1, 1,  0, 1 };
+
+    // Cover the whole viewport regardless of the current matrices
+    glMatrixMode(GL_PROJECTION);
+    glPushMatrix();
+    glLoadIdentity();
+    glMatrixMode(GL_MODELVIEW);
+    glPushMatrix();
+    glLoadIdentity();
+
+    glEnable(GL_TEXTURE_2D);
+    glBindTexture(GL_TEXTURE_2D, tgt->texture);
+    glColor4f(1, 1, 1, 1);
+    glVertexPointer(2, GL_FLOAT, 0, corners);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glTexCoordPointer(2, GL_FLOAT, 0, texcoords);
+    glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+    glDisableClientState(GL_COLOR_ARRAY);
+
+    glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+    count_draws(1, 4);
+
+    glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glDisable(GL_TEXTURE_2D);
+
+    glPopMatrix();
+    glMatrixMode(GL_PROJECTION);
+    glPopMatrix();
+    glMatrixMode(GL_MODELVIEW);
+
+    check_error();
+    CAMLreturn0;
+}
+
+CAMLprim void gl_release_render_target(value target)
+{
+    CAMLparam1(target);
+    struct render_target *tgt = Render_target_val(target);
+
+    delete_dead_objects();
+    if (tgt->fbo) glDeleteFramebuffers(1, &tgt->fbo);
+    if (tgt->texture) glDeleteTextures(1, &tgt->texture);
+    if (tgt->depth) glDeleteRenderbuffers(1, &tgt->depth);
+    tgt->fbo = tgt->texture = tgt->depth = 0;
+
+    check_error();
+    CAMLreturn0;
+}
+
+/*
+ * Textures
+ *
+ * Texels are uploaded straight from the bigarray (height x width x
+ * channels), without intermediate copy.
+ */
+
+struct texture {
+    GLuint name;    // 0 once released
+    int width, height;
+    unsigned channels;
+    GLenum type;
+};
+
+#define Texture_val(v) ((struct texture *)Data_custom_val(v))
+
+static void finalize_texture(value texture)
+{
+    defer_delete(glDeleteTextures, Texture_val(texture)->name);
+}
+
+static struct custom_operations texture_ops = {
+    .identifier = "glop.texture",
+    .finalize = finalize_texture,
+    .compare = custom_compare_default,
+    .hash = custom_hash_default,
+    .serialize = custom_serialize_default,
+    .deserialize = custom_deserialize_default,
+    .compare_ext = custom_compare_ext_default,
+};
+
+static GLenum glformat_of_channels(unsigned channels)
+{
+    static GLenum const formats[] = { GL_LUMINANCE, GL_LUMINANCE_ALPHA, GL_RGB, GL_RGBA };
+    assert(channels >= 1 && channels <= sizeof_array(formats));
+    return formats[channels - 1];
+}
+
+// Returns the texels of a texture_data and sets their size, channels and type.
+static void const *texels_data(value texels, int *width, int *height, unsigned *channels, GLenum *type)
+{
+    assert(Is_block(texels));
+    struct caml_ba_array *arr = Caml_ba_array_val(Field(texels, 0));
+    assert(arr->num_dims == 3);
+    if (Tag_val(texels) == 0) { // Byte_texels
+        assert((arr->flags & CAML_BA_KIND_MASK) == CAML_BA_UINT8);
+        *type = GL_UNSIGNED_BYTE;
+    } else {                    // Float_texels
+        assert(Tag_val(texels) == 1);
+        assert((arr->flags & CAML_BA_KIND_MASK) == CAML_BA_FLOAT32);
+        if (! has_float_textures()) caml_failwith("texture: no float textures");
+        *type = GL_FLOAT;
+    }
+    *height = arr->dim[0];
+    *width = arr->dim[1];
+    *channels = arr->dim[2];
+    if (*channels < 1 || *channels > 4) caml_invalid_argument("texture: bad number of channels");
+    return arr->data;
+}
+
+// Sets the given parameters, or the defaults (Linear, Clamp) for missing ones
+// if with_defaults.
+static void set_texture_params(value filter_opt, value wrap_opt, bool with_defaults)
+{
+    if (Is_block(filter_opt) || with_defaults) {
+        // Nearest | Linear
+        GLint const filter = Is_block(filter_opt) && Int_val(Field(filter_opt, 0)) == 0 ? GL_NEAREST : GL_LINEAR;
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
+    }
+    if (Is_block(wrap_opt) || with_defaults) {
+        // Clamp | Repeat
+        GLint const wrap = Is_block(wrap_opt) && Int_val(Field(wrap_opt, 0)) == 1 ? GL_REPEAT : GL_CLAMP_TO_EDGE;
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, wrap);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, wrap);
+    }
+}
+
+CAMLprim value gl_make_texture(value filter_opt, value wrap_opt, value texels)
+{
+    CAMLparam3(filter_opt, wrap_opt, texels);
+    CAMLlocal1(texture);
+
+    struct texture tex;
+    void const *data = texels_data(texels, &tex.width, &tex.height, &tex.channels, &tex.type);
+
+    delete_dead_objects();
+
+    texture = caml_alloc_custom(&texture_ops, sizeof(struct texture), 0, 1);
+    glGenTextures(1, &tex.name);
+    glBindTexture(GL_TEXTURE_2D, tex.name);
+    set_texture_params(filter_opt, wrap_opt, true);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    GLenum const format = glformat_of_channels(tex.channels);
+    glTexImage2D(GL_TEXTURE_2D, 0, format, tex.width, tex.height, 0, format, tex.type, data);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    *Texture_val(texture) = tex;
+
+    check_error();
+    CAMLreturn(texture);
+}
+
+CAMLprim void gl_set_texture_params(value filter_opt, value wrap_opt, value texture)
+{
+    CAMLparam3(filter_opt, wrap_opt, texture);
+    struct texture *tex = Texture_val(texture);
+    if (! tex->name) caml_invalid_argument("set_texture_params: texture was released");
+
+    glBindTexture(GL_TEXTURE_2D, tex->name);
+    set_texture_params(filter_opt, wrap_opt, false);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    check_error();
+    CAMLreturn0;
+}
+
+CAMLprim void gl_update_texture(value texture, value x, value y, value texels)
+{
+    CAMLparam4(texture, x, y, texels);
+    struct texture *tex = Texture_val(texture);
+    if (! tex->name) caml_invalid_argument("update_texture: texture was released");
+
+    int width, height;
+    unsigned channels;
+    GLenum type;
+    void const *data = texels_data(texels, &width, &height, &channels, &type);
+    if (channels != tex->channels || type != tex->type ||
+        Long_val(x) < 0 || Long_val(y) < 0 ||
+        Long_val(x) + width > tex->width || Long_val(y) + height > tex->height) {
+        caml_invalid_argument("update_texture");
+    }
+
+    glBindTexture(GL_TEXTURE_2D, tex->name);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, Long_val(x), Long_val(y), width, height,
+                    glformat_of_channels(channels), type, data);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    check_error();
+    CAMLreturn0;
+}
+
+CAMLprim void gl_release_texture(value texture)
+{
+    CAMLparam1(texture);
+    struct texture *tex = Texture_val(texture);
+
+    delete_dead_objects();
+    if (tex->name) glDeleteTextures(1, &tex->name);
+    tex->name = 0;
+
+    check_error();
+    CAMLreturn0;
+}
+
+// Binds the texture and texture coordinates of an optional
+// (texture * texcoord_array) and returns the number of texcoords (0 if None).
+static int use_texture(value texture_opt)
+{
+    CAMLparam1(texture_opt);
+    CAMLlocal2(texture, texcoords);
+    if (! Is_block(texture_opt)) CAMLreturnT(int, 0);
+
+    texture = Field(Field(texture_opt, 0), 0);
+    texcoords = Field(Field(texture_opt, 0), 1);
+    struct texture *tex = Texture_val(texture);
+    if (! tex->name) caml_invalid_argument("render: texture was released");
+
+    struct caml_ba_array *arr = Caml_ba_array_val(texcoords);
+    assert(arr->num_dims == 2 && arr->dim[1] == 2);
+    assert((arr->flags & CAML_BA_KIND_MASK) == CAML_BA_FLOAT32);
+
+    glEnable(GL_TEXTURE_2D);
+    glBindTexture(GL_TEXTURE_2D, tex->name);
+    glTexCoordPointer(2, GL_FLOAT, 0, arr->data);
+    glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+
+    CAMLreturnT(int, arr->dim[0]);
+}
+
+static void unuse_texture(value texture_opt)
+{
+    if (! Is_block(texture_opt)) return;
+
+    glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glDisable(GL_TEXTURE_2D);
+}
+
+/*
+ * Color mapping
+ *
+ * Scalar values are used as texture coordinates into a palette texture
+ * (which first row is used), the range being applied by the texture
+ * matrix. So changing the range costs nothing.
+ */
+
+CAMLprim void gl_render_mapped(value range_opt, value render_type, value vertices, value palette, value values)
+{
+    CAMLparam5(range_opt, render_type, vertices, palette, values);
+    CAMLlocal1(range);
+    assert(Is_long(render_type));
+
+    struct texture *tex = Texture_val(palette);
+    if (! tex->name) caml_invalid_argument("render_mapped: palette was released");
+
+    double min = 0., max = 1.;
+    if (Is_block(range_opt)) {
+        range = Field(range_opt, 0);
+        min = Double_val(Field(range, 0));
+        max = Double_val(Field(range, 1));
+        if (! (max > min)) caml_invalid_argument("render_mapped: empty range");
+    }
+
+    int const nb_vertices = use_vertex_array(vertices);
+    struct caml_ba_array *values_arr = Caml_ba_array_val(values);
+    assert(values_arr->num_dims == 1);
+    assert((values_arr->flags & CAML_BA_KIND_MASK) == CAML_BA_FLOAT32);
+    if (values_arr->dim[0] < nb_vertices) caml_invalid_argument("render_mapped: not enough values");
+
+    // Map min to the center of the first texel and max to that of the last
+    double const n = tex->width;
+    double const a = (n - 1.) / (n * (max - min));
+    double const mapping[16] = {
+        a, 0., 0., 0.,
+        0., 0., 0., 0.,
+        0., 0., 1., 0.,
+        0.5 / n - a * min, 0.5, 0., 1.,
+    };
+    glMatrixMode(GL_TEXTURE);
+    load_matrix(mapping);
+    glMatrixMode(GL_MODELVIEW);
+
+    glColor4f(1, 1, 1, 1);
+    glDisableClientState(GL_COLOR_ARRAY);
+    glEnable(GL_TEXTURE_2D);
+    glBindTexture(GL_TEXTURE_2D, tex->name);
+    texcoord1_pointer(values_arr->data, nb_vertices);
+    glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+
+    GLenum const mode = glmode_of_render_type(Int_val(render_type));
+    glDrawArrays(mode, 0, nb_vertices);
+    count_draws(1, nb_vertices);
+
+    glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glDisable(GL_TEXTURE_2D);
+    glMatrixMode(GL_TEXTURE);
+    glLoadIdentity();
+    glMatrixMode(GL_MODELVIEW);
+
+    check_error();
+    CAMLreturn0;
+}
@@ -1,5 +1,28 @@
+#define GL_GLEXT_PROTOTYPES
 #include <EGL/egl.h>
 #include <GLES/gl.h>
+#include <GLES/glext.h>
+
+// Framebuffer objects are an extension in GLES 1
+#define glGenFramebuffers glGenFramebuffersOES
+#define glDeleteFramebuffers glDeleteFramebuffersOES
+#define glBindFramebuffer glBindFramebufferOES
+#define glCheckFramebufferStatus glCheckFramebufferStatusOES
+#define glFramebufferTexture2D glFramebufferTexture2DOES
+#define glFramebufferRenderbuffer glFramebufferRenderbufferOES
+#define glGenRenderbuffers glGenRenderbuffersOES
+#define glDeleteRenderbuffers glDeleteRenderbuffersOES
+#define glBindRenderbuffer glBindRenderbufferOES
+#define glRenderbufferStorage glRenderbufferStorageOES
+#define GL_FRAMEBUFFER GL_FRAMEBUFFER_OES
+#define GL_FRAMEBUFFER_BINDING GL_FRAMEBUFFER_BINDING_OES
+#define GL_FRAMEBUFFER_COMPLETE GL_FRAMEBUFFER_COMPLETE_OES
+#define GL_RENDERBUFFER GL_RENDERBUFFER_OES
+#define GL_COLOR_ATTACHMENT0 GL_COLOR_ATTACHMENT0_OES
+#define GL_DEPTH_ATTACHMENT GL_DEPTH_ATTACHMENT_OES
+#define GL_DEPTH_COMPONENT16 GL_DEPTH_COMPONENT16_OES
+#define GL_INVALID_FRAMEBUFFER_OPERATION GL_INVALID_FRAMEBUFFER_OPERATION_OES
+
 #include "gl_common.c"
 
 #define PRIx "f"
@@ -48,7 +71,7 @@ static int init_egl(bool with_depth, bool with_alpha)
     EGLint attrs[] = {
         EGL_RENDER_BUFFER, double_buffer ? EGL_BACK_BUFFER : EGL_SINGLE_BUFFER,
         EGL_NONE
-    }
+    };
     egl_surface = eglCreateWindowSurface(egl_display, ecfg, (void*)x_win, attrs);
     if (egl_surface == EGL_NO_SURFACE) {
         fprintf(stderr, "Unable to create EGL surface (eglError: %d)\n", eglGetError());
@@ -127,16 +150,31 @@ static int init_x(char const *title, bool with_depth, bool with_alpha, bool with
     return init_egl(with_depth, with_alpha);
 }
 
+static int init_offscreen(bool with_depth, bool with_alpha, bool with_msaa, int width, int height)
+{
+    egl_display = offscreen_display();
+    if (egl_display == EGL_NO_DISPLAY) return -1;
+
+    EGLint const ctxattr[] = { EGL_NONE };
+    return init_egl_pbuffer(egl_display, EGL_OPENGL_ES_API, EGL_OPENGL_ES_BIT,
+                            with_depth, with_alpha, with_msaa, width, height,
+                            &egl_surface, &egl_context, ctxattr);
+}
+
 CAMLprim void gl_exit(void)
 {
     CAMLparam0();
 
-    print_error();
+    if (offscreen) {
+        eglMakeCurrent(egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    }
     eglDestroyContext(egl_display, egl_context);
     eglDestroySurface(egl_display, egl_surface);
     eglTerminate(egl_display);
-    XDestroyWindow(x_display, x_win);
-    XCloseDisplay(x_display);
+    if (! offscreen) {
+        XDestroyWindow(x_display, x_win);
+        XCloseDisplay(x_display);
+    }
 
     CAMLreturn0;
 }
@@ -193,136 +231,131 @@ static void reset_clear_depth(value depth)
 
 CAMLprim void gl_swap_buffers(void)
 {
+    delete_dead_objects();
+    frame_stats_before_swap();
     caml_release_runtime_system();
-    if (double_buffer) {
+    if (double_buffer && ! offscreen) {
         int res = eglSwapBuffers(egl_display, egl_surface);
         assert(res == EGL_TRUE);
     } else {
         glFlush();
     }
-    print_error();
     caml_acquire_runtime_system();
+    frame_stats_after_swap();
+    check_frame_errors();
+}
+
+CAMLprim value gl_set_swap_interval(value interval)
+{
+    return Val_bool(eglSwapInterval(egl_display, Int_val(interval)));
 }
 
 /*
  * Matrices
  */
 
-static void load_vector(GLfixed *m, value vector)
+static void load_matrix(double const *m)
 {
-    CAMLparam1(vector);
-    CAMLlocal1(natint);
+    GLfloat mf[16];
+    for (unsigned i = 0; i < sizeof_array(mf); i++) mf[i] = m[i];
+    glLoadMatrixf(mf);
+    check_error();
+}
 
-    // vector is a nativeint array of length = 4
-    assert(Is_block(vector) && Tag_val(vector) == 0);
-    assert(Wosize_val(vector) == 4);
+CAMLprim void gl_set_depth_range(value near, value far)
+{
+    CAMLparam2(near, far);
+    assert(Is_long(near));  // FIXME: seams bogus, should be nativeints
+    assert(Is_long(far));
 
-    for (unsigned c = 0; c < 4; c++) {
-        natint = Field(vector, c);
-        assert(Is_block(natint) && Tag_val(natint) == Custom_tag);
-        m[c] = Nativeint_val(natint);
-    }
+    glDepthRangex(Long_val(near), Long_val(far));
 
+    check_error();
     CAMLreturn0;
 }
 
-static void do_with_matrix(value matrix, void (*func)(GLfixed const *m))
+/*
+ * Rendering
+ */
+
+static GLenum gltype_of_bigarray(struct caml_ba_array const *arr)
 {
-    CAMLparam1(matrix);
+    assert((arr->flags & CAML_BA_KIND_MASK) == CAML_BA_NATIVE_INT);
+    (void)arr;
+    return GL_FIXED;
+}
 
-    // matrix is a nativeint array array
-    assert(Is_block(matrix) && Tag_val(matrix) == 0);
-    assert(Wosize_val(matrix) == 4);
+static bool has_uint_indices(void)
+{
+    static int has_it = -1; // unknown yet
+    if (has_it < 0) has_it = has_extension("GL_OES_element_index_uint");
+    return has_it;
+}
 
-    // We are going to extend-store the matrix here :
-    GLfixed m[4][4];
-    for (unsigned col = 0; col < 4; col++) {
-        load_vector(&m[col][0], Field(matrix, col));
-    }
+static bool has_float_textures(void)
+{
+    // GLES 1 has no GL_FLOAT texel type
+    return false;
+}
 
-    func(&m[0][0]);
+static struct scratch texcoords;
 
-    print_error();
-    CAMLreturn0;
+static void texcoord1_pointer(float const *values, int nb_values)
+{
+    // GLES 1 wants at least 2 texture coordinates per vertex
+    GLfloat *st = scratch_alloc(&texcoords, 2 * nb_values * sizeof(*st));
+    for (int v = 0; v < nb_values; v++) {
+        st[2*v] = values[v];
+        st[2*v + 1] = 0.;
+    }
+    glTexCoordPointer(2, GL_FLOAT, 0, st);
 }
 
-static void load_matrix(value matrix)
+static bool has_framebuffers(void)
 {
-    do_with_matrix(matrix, glLoadMatrixx);
+    static int has_it = -1; // unknown yet
+    if (has_it < 0) has_it = has_extension("GL_OES_framebuffer_object");
+    return has_it;
 }
 
-CAMLprim void gl_set_depth_range(value near, value far)
+static bool draw_instanced(GLenum mode, value shape, struct caml_ba_array const *offsets, struct caml_ba_array const *scales, value color_specs)
 {
-    CAMLparam2(near, far);
-    assert(Is_long(near));  // FIXME: seams bogus, should be nativeints
-    assert(Is_long(far));
-
-    glDepthRangex(Long_val(near), Long_val(far));
-
-    print_error();
-    CAMLreturn0;
+    // The fixed pipeline has no per-instance attributes
+    (void)mode; (void)shape; (void)offsets; (void)scales; (void)color_specs;
+    return false;
 }
 
-/*
- * Rendering
- */
-
-CAMLprim void gl_render(value render_type, value vertices, value color_specs)
+static void multi_draw_arrays(GLenum mode, GLint const *firsts, GLsizei const *counts, GLsizei nb_draws)
 {
-    CAMLparam3(render_type, vertices, color_specs);
-    CAMLlocal1(colors);
-    assert(Is_long(render_type));
-    assert(Is_block(vertices) && Tag_val(vertices) == Custom_tag);
-    assert(Is_block(color_specs));
-    int nb_vertices = 0, nb_colors = 0;
-
-    // vertices
-    struct caml_ba_array *vertices_arr = Caml_ba_array_val(vertices);
-    assert(vertices_arr->num_dims == 2);
-    assert(vertices_arr->dim[1] >= 2 && vertices_arr->dim[1] <= 4);
-    nb_vertices = vertices_arr->dim[0];
-    glVertexPointer(vertices_arr->dim[1], GL_FIXED, 0, vertices_arr->data);
-    glEnableClientState(GL_VERTEX_ARRAY);
-
-    // colors
-    if (Tag_val(color_specs) == 0) {    // Array
-        colors = Field(color_specs, 0);
-        assert(Is_block(colors) && Tag_val(colors) == Custom_tag);
-        struct caml_ba_array *colors_arr = Caml_ba_array_val(colors);
-        assert(colors_arr->num_dims == 2);
-        unsigned const c_dim = colors_arr->dim[1];
-        assert(c_dim == 3 || c_dim == 4);
-        nb_colors = colors_arr->dim[0];
-        glColorPointer(c_dim, GL_FIXED, 0, colors_arr->data);
-        glEnableClientState(GL_COLOR_ARRAY);
-    } else {
-        assert(Tag_val(color_specs) == 1);
-        colors = Field(color_specs, 0);
-        unsigned const c_dim = Wosize_val(colors);
-        assert(c_dim == 3 || c_dim == 4);
-        assert(Tag_val(Field(colors, 0)) == Custom_tag);
-        if (c_dim == 4) {
-            glColor4x(
-                Nativeint_val(Field(colors, 0)),
-                Nativeint_val(Field(colors, 1)),
-                Nativeint_val(Field(colors, 2)),
-                Nativeint_val(Field(colors, 3)));
-        } else {
-            glColor4x(
-                Nativeint_val(Field(colors, 0)),
-                Nativeint_val(Field(colors, 1)),
-                Nativeint_val(Field(colors, 2)),
-                0x10000);
+    // No glMultiDrawArrays in GLES 1
+    for (GLsizei d = 0; d < nb_draws; d++) {
+        if (counts[d] > 0) {
+            glDrawArrays(mode, firsts[d], counts[d]);
+            count_draws(1, counts[d]);
         }
-        glDisableClientState(GL_COLOR_ARRAY);
     }
+}
 
-    if (nb_colors > 0) assert(nb_colors == nb_vertices);
-
-    GLenum const mode = glmode_of_render_type(Int_val(render_type));
-    glDrawArrays(mode, 0, nb_vertices);
+static void set_uniq_color(value colors)
+{
+    CAMLparam1(colors);
+    unsigned const c_dim = Wosize_val(colors);
+    assert(c_dim == 3 || c_dim == 4);
+    assert(Tag_val(Field(colors, 0)) == Custom_tag);
+
+    if (c_dim == 4) {
+        glColor4x(
+            Nativeint_val(Field(colors, 0)),
+            Nativeint_val(Field(colors, 1)),
+            Nativeint_val(Field(colors, 2)),
+            Nativeint_val(Field(colors, 3)));
+    } else {
+        glColor4x(
+            Nativeint_val(Field(colors, 0)),
+            Nativeint_val(Field(colors, 1)),
+            Nativeint_val(Field(colors, 2)),
+            0x10000);
+    }
 
-    print_error();
     CAMLreturn0;
 }
-
@@ -0,0 +1,692 @@
+#define GL_GLEXT_PROTOTYPES
+#include <EGL/egl.h>
+#include <GLES3/gl3.h>
+#include <GLES2/gl2ext.h>
+
+/*
+ * This backend uses GLES 3 shaders, but gl_common.c is written for the fixed
+ * pipeline. So the few fixed pipeline functions it calls are implemented
+ * below on top of a shader program, with uniforms for the matrices and
+ * vertex attributes for the arrays.
+ */
+
+#define GL_MODELVIEW           0x1700
+#define GL_PROJECTION          0x1701
+#define GL_FLAT                0x1D00
+#define GL_SMOOTH              0x1D01
+#define GL_VERTEX_ARRAY        0x8074
+#define GL_COLOR_ARRAY         0x8076
+#define GL_TEXTURE_COORD_ARRAY 0x8078
+#define GL_MULTISAMPLE         0x809D
+#define GL_STACK_OVERFLOW      0x0503
+#define GL_STACK_UNDERFLOW     0x0504
+#define GL_READ_ONLY           0x88B8
+#define GL_TIME_ELAPSED        GL_TIME_ELAPSED_EXT
+
+// Not exported by libGLESv2, so looked up in has_timer_queries
+static PFNGLGETQUERYOBJECTUI64VEXTPROC get_query_object_ui64v;
+#define glGetQueryObjectui64v get_query_object_ui64v
+
+static void sp_matrix_mode(GLenum mode);
+static void sp_push_matrix(void);
+static void sp_pop_matrix(void);
+static void sp_load_identity(void);
+static void sp_shade_model(GLenum mode);
+static void sp_enable(GLenum cap);
+static void sp_disable(GLenum cap);
+static void sp_enable_client_state(GLenum array);
+static void sp_disable_client_state(GLenum array);
+static void sp_vertex_pointer(GLint size, GLenum type, GLsizei stride, void const *pointer);
+static void sp_color_pointer(GLint size, GLenum type, GLsizei stride, void const *pointer);
+static void sp_tex_coord_pointer(GLint size, GLenum type, GLsizei stride, void const *pointer);
+static void sp_color4f(GLfloat r, GLfloat g, GLfloat b, GLfloat a);
+static void sp_draw_arrays(GLenum mode, GLint first, GLsizei count);
+static void sp_draw_elements(GLenum mode, GLsizei count, GLenum type, void const *indices);
+static void *sp_map_buffer(GLenum target, GLenum access);
+
+#define glMatrixMode sp_matrix_mode
+#define glPushMatrix sp_push_matrix
+#define glPopMatrix sp_pop_matrix
+#define glLoadIdentity sp_load_identity
+#define glShadeModel sp_shade_model
+#define glEnable sp_enable
+#define glDisable sp_disable
+#define glEnableClientState sp_enable_client_state
+#define glDisableClientState sp_disable_client_state
+#define glVertexPointer sp_vertex_pointer
+#define glColorPointer sp_color_pointer
+#define glTexCoordPointer sp_tex_coord_pointer
+#define glColor4f sp_color4f
+#define glDrawArrays sp_draw_arrays
+#define glDrawElements sp_draw_elements
+#define glMapBuffer sp_map_buffer
+
+#include "gl_common.c"
+
+#undef glMatrixMode
+#undef glPushMatrix
+#undef glPopMatrix
+#undef glLoadIdentity
+#undef glShadeModel
+#undef glEnable
+#undef glDisable
+#undef glEnableClientState
+#undef glDisableClientState
+#undef glVertexPointer
+#undef glColorPointer
+#undef glTexCoordPointer
+#undef glColor4f
+#undef glDrawArrays
+#undef glDrawElements
+#undef glMapBuffer
+
+/*
+ * Shader program
+ */
+
+enum attribute { ATTR_POSITION, ATTR_COLOR, ATTR_TEXCOORD, ATTR_OFFSET, ATTR_SCALE };
+
+static char const vertex_shader[] =
+    "uniform mat4 projection;\n"
+    "uniform mat4 modelview;\n"
+    "uniform mat4 texture_matrix;\n"
+    "in vec4 position;\n"
+    "in vec4 color;\n"
+    "in vec2 texcoord;\n"
+    "in vec3 offset;\n"   // per instance, or 0 when not instanced
+    "in vec3 scale;\n"    // per instance, or 1 when not instanced
+    "INTERP out vec4 v_color;\n"
+    "out vec2 v_texcoord;\n"
+    "void main() {\n"
+    "    gl_Position = projection * modelview * vec4(position.xyz * scale + offset, position.w);\n"
+    "    gl_PointSize = 1.0;\n"
+    "    v_color = color;\n"
+    "    v_texcoord = (texture_matrix * vec4(texcoord, 0.0, 1.0)).xy;\n"
+    "}\n";
+
+static char const fragment_shader[] =
+    "precision mediump float;\n"
+    "uniform bool textured;\n"
+    "uniform sampler2D sampler;\n"
+    "INTERP in vec4 v_color;\n"
+    "in vec2 v_texcoord;\n"
+    "out vec4 frag_color;\n"
+    "void main() {\n"
+    "    frag_color = textured ? v_color * texture(sampler, v_texcoord) : v_color;\n"
+    "}\n";
+
+struct program {
+    GLuint name;
+    GLint projection, modelview, texture_matrix, textured;
+};
+
+// One program per shading model, since interpolation is fixed at compile time
+static struct program flat_program, smooth_program;
+static struct program *program = &flat_program;
+
+#define MATRIX_PUSH_DEPTH 4
+
+static struct {
+    GLfloat m[MATRIX_PUSH_DEPTH][16];
+    unsigned top;
+} matrices[3];  // 0 = projection, 1 = modelview, 2 = texture
+
+static unsigned matrix_mode = 1;
+static void sp_load_identity_of(unsigned mode);
+static bool textured;
+static bool uniforms_dirty = true;
+
+static GLuint compile_shader(GLenum type, char const *interp, char const *source)
+{
+    char const *sources[] = { "#version 300 es\n", interp, source };
+    GLuint shader = glCreateShader(type);
+    glShaderSource(shader, sizeof_array(sources), sources, NULL);
+    glCompileShader(shader);
+
+    GLint ok;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+    if (! ok) {
+        char log[1024];
+        glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+        fprintf(stderr, "Cannot compile shader: %s\n", log);
+        glDeleteShader(shader);
+        return 0;
+    }
+    return shader;
+}
+
+static int init_program(struct program *prog, char const *interp)
+{
+    GLuint vs = compile_shader(GL_VERTEX_SHADER, interp, vertex_shader);
+    GLuint fs = compile_shader(GL_FRAGMENT_SHADER, interp, fragment_shader);
+    if (! vs || ! fs) return -1;
+
+    prog->name = glCreateProgram();
+    glAttachShader(prog->name, vs);
+    glAttachShader(prog->name, fs);
+    glBindAttribLocation(prog->name, ATTR_POSITION, "position");
+    glBindAttribLocation(prog->name, ATTR_COLOR, "color");
+    glBindAttribLocation(prog->name, ATTR_TEXCOORD, "texcoord");
+    glBindAttribLocation(prog->name, ATTR_OFFSET, "offset");
+    glBindAttribLocation(prog->name, ATTR_SCALE, "scale");
+    glLinkProgram(prog->name);
+    glDeleteShader(vs);
+    glDeleteShader(fs);
+
+    GLint ok;
+    glGetProgramiv(prog->name, GL_LINK_STATUS, &ok);
+    if (! ok) {
+        char log[1024];
+        glGetProgramInfoLog(prog->name, sizeof(log), NULL, log);
+        fprintf(stderr, "Cannot link program: %s\n", log);
+        return -1;
+    }
+
+    prog->projection = glGetUniformLocation(prog->name, "projection");
+    prog->modelview = glGetUniformLocation(prog->name, "modelview");
+    prog->texture_matrix = glGetUniformLocation(prog->name, "texture_matrix");
+    prog->textured = glGetUniformLocation(prog->name, "textured");
+    return 0;
+}
+
+static int init_shaders(void)
+{
+    if (0 != init_program(&flat_program, "#define INTERP flat\n")) return -1;
+    if (0 != init_program(&smooth_program, "#define INTERP smooth\n")) return -1;
+
+    for (unsigned s = 0; s < sizeof_array(matrices); s++) {
+        matrices[s].top = 0;
+        sp_load_identity_of(s);
+    }
+    glVertexAttrib4f(ATTR_COLOR, 1., 1., 1., 1.);
+    // Instance attributes are only enabled by draw_instanced
+    glVertexAttrib4f(ATTR_OFFSET, 0., 0., 0., 0.);
+    glVertexAttrib4f(ATTR_SCALE, 1., 1., 1., 1.);
+    glVertexAttribDivisor(ATTR_OFFSET, 1);
+    glVertexAttribDivisor(ATTR_SCALE, 1);
+    uniforms_dirty = true;
+    return 0;
+}
+
+// Must be called before any draw
+static void use_program(void)
+{
+    if (! uniforms_dirty) return;
+
+    glUseProgram(program->name);
+    glUniformMatrix4fv(program->projection, 1, GL_FALSE, matrices[0].m[matrices[0].top]);
+    glUniformMatrix4fv(program->modelview, 1, GL_FALSE, matrices[1].m[matrices[1].top]);
+    glUniformMatrix4fv(program->texture_matrix, 1, GL_FALSE, matrices[2].m[matrices[2].top]);
+    glUniform1i(program->textured, textured);
+    uniforms_dirty = false;
+}
+
+/*
+ * Fixed pipeline emulation
+ */
+
+static void sp_matrix_mode(GLenum mode)
+{
+    switch (mode) {
+        case GL_PROJECTION: matrix_mode = 0; break;
+        case GL_MODELVIEW: matrix_mode = 1; break;
+        default:
+            assert(mode == GL_TEXTURE);
+            matrix_mode = 2;
+    }
+}
+
+static void sp_push_matrix(void)
+{
+    unsigned const top = matrices[matrix_mode].top;
+    assert(top + 1 < MATRIX_PUSH_DEPTH);
+    memcpy(matrices[matrix_mode].m[top + 1], matrices[matrix_mode].m[top], sizeof(matrices[0].m[0]));
+    matrices[matrix_mode].top ++;
+}
+
+static void sp_pop_matrix(void)
+{
+    assert(matrices[matrix_mode].top > 0);
+    matrices[matrix_mode].top --;
+    uniforms_dirty = true;
+}
+
+static void sp_load_identity_of(unsigned mode)
+{
+    GLfloat *m = matrices[mode].m[matrices[mode].top];
+    for (unsigned i = 0; i < 16; i++) m[i] = i % 5 == 0 ? 1. : 0.;
+    uniforms_dirty = true;
+}
+
+static void sp_load_identity(void)
+{
+    sp_load_identity_of(matrix_mode);
+}
+
+static void sp_shade_model(GLenum mode)
+{
+    struct program *prev = program;
+    program = mode == GL_FLAT ? &flat_program : &smooth_program;
+    if (program != prev) uniforms_dirty = true;
+}
+
+static void sp_enable(GLenum cap)
+{
+    if (cap == GL_TEXTURE_2D) {
+        if (! textured) uniforms_dirty = true;
+        textured = true;
+    } else if (cap != GL_MULTISAMPLE) {     // always on when there are samples
+        glEnable(cap);
+    }
+}
+
+static void sp_disable(GLenum cap)
+{
+    if (cap == GL_TEXTURE_2D) {
+        if (textured) uniforms_dirty = true;
+        textured = false;
+    } else if (cap != GL_MULTISAMPLE) {
+        glDisable(cap);
+    }
+}
+
+static GLuint attribute_of_array(GLenum array)
+{
+    switch (array) {
+        case GL_VERTEX_ARRAY: return ATTR_POSITION;
+        case GL_COLOR_ARRAY: return ATTR_COLOR;
+        default:
+            assert(array == GL_TEXTURE_COORD_ARRAY);
+            return ATTR_TEXCOORD;
+    }
+}
+
+static void sp_enable_client_state(GLenum array)
+{
+    glEnableVertexAttribArray(attribute_of_array(array));
+}
+
+static void sp_disable_client_state(GLenum array)
+{
+    glDisableVertexAttribArray(attribute_of_array(array));
+}
+
+static void sp_vertex_pointer(GLint size, GLenum type, GLsizei stride, void const *pointer)
+{
+    glVertexAttribPointer(ATTR_POSITION, size, type, GL_FALSE, stride, pointer);
+}
+
+static void sp_color_pointer(GLint size, GLenum type, GLsizei stride, void const *pointer)
+{
+    glVertexAttribPointer(ATTR_COLOR, size, type, type != GL_FLOAT, stride, pointer);
+}
+
+static void sp_tex_coord_pointer(GLint size, GLenum type, GLsizei stride, void const *pointer)
+{
+    glVertexAttribPointer(ATTR_TEXCOORD, size, type, GL_FALSE, stride, pointer);
+}
+
+static void sp_color4f(GLfloat r, GLfloat g, GLfloat b, GLfloat a)
+{
+    // Used when the color array is disabled
+    glVertexAttrib4f(ATTR_COLOR, r, g, b, a);
+}
+
+static void sp_draw_arrays(GLenum mode, GLint first, GLsizei count)
+{
+    use_program();
+    glDrawArrays(mode, first, count);
+}
+
+static void sp_draw_elements(GLenum mode, GLsizei count, GLenum type, void const *indices)
+{
+    use_program();
+    glDrawElements(mode, count, type, indices);
+}
+
+static void *sp_map_buffer(GLenum target, GLenum access)
+{
+    assert(access == GL_READ_ONLY);
+    GLint size;
+    glGetBufferParameteriv(target, GL_BUFFER_SIZE, &size);
+    return glMapBufferRange(target, 0, size, GL_MAP_READ_BIT);
+}
+
+/*
+ * Init
+ */
+
+static EGLDisplay egl_display;
+static EGLSurface egl_surface;
+static EGLContext egl_context;
+
+static EGLint const gles3_ctxattr[] = {
+    EGL_CONTEXT_CLIENT_VERSION, 3,
+    EGL_NONE
+};
+
+static void init_blending(bool with_alpha)
+{
+    if (with_alpha) {
+        glEnable(GL_BLEND);
+        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    }
+}
+
+static int init_egl(bool with_depth, bool with_alpha, bool with_msaa)
+{
+    egl_display = eglGetDisplay((EGLNativeDisplayType)x_display);
+    if (egl_display == EGL_NO_DISPLAY) {
+        fprintf(stderr, "Got no EGL display.\n");
+        return -1;
+    }
+
+    if (! eglInitialize(egl_display, NULL, NULL)) {
+        fprintf(stderr, "Unable to initialize EGL\n");
+        return -1;
+    }
+
+    if (! eglBindAPI(EGL_OPENGL_ES_API)) {
+        fprintf(stderr, "Cannot bind EGL API (eglError: %d)\n", eglGetError());
+        return -1;
+    }
+
+    EGLint attrs[] = {
+        EGL_SURFACE_TYPE, EGL_WINDOW_BIT,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_ES3_BIT,
+        EGL_RED_SIZE, 4, EGL_GREEN_SIZE, 4, EGL_BLUE_SIZE, 4,
+        EGL_ALPHA_SIZE, with_alpha ? 4 : 0,
+        EGL_DEPTH_SIZE, with_depth ? 4 : 0,
+        EGL_SAMPLE_BUFFERS, with_msaa ? 1 : 0,
+        EGL_SAMPLES, with_msaa ? 4 : 0,
+        EGL_NONE
+    };
+
+    EGLConfig config;
+    EGLint num_config;
+    if (! eglChooseConfig(egl_display, attrs, &config, 1, &num_config) || num_config != 1) {
+        fprintf(stderr, "Failed to choose config (eglError: %d)\n", eglGetError());
+        return -1;
+    }
+
+    EGLint const surface_attrs[] = {
+        EGL_RENDER_BUFFER, double_buffer ? EGL_BACK_BUFFER : EGL_SINGLE_BUFFER,
+        EGL_NONE
+    };
+    egl_surface = eglCreateWindowSurface(egl_display, config, (EGLNativeWindowType)x_win, surface_attrs);
+    if (egl_surface == EGL_NO_SURFACE) {
+        fprintf(stderr, "Unable to create EGL surface (eglError: %d)\n", eglGetError());
+        return -1;
+    }
+
+    egl_context = eglCreateContext(egl_display, config, EGL_NO_CONTEXT, gles3_ctxattr);
+    if (egl_context == EGL_NO_CONTEXT) {
+        fprintf(stderr, "Unable to create EGL context (eglError: %d)\n", eglGetError());
+        return -1;
+    }
+
+    if (EGL_TRUE != eglMakeCurrent(egl_display, egl_surface, egl_surface, egl_context)) {
+        fprintf(stderr, "Unable to associate context and surface (eglError: %d)\n", eglGetError());
+        return -1;
+    }
+
+    return 0;
+}
+
+static int init_x(char const *title, bool with_depth, bool with_alpha, bool with_msaa, int width, int height)
+{
+    x_display = XOpenDisplay(NULL);
+    if (! x_display) {
+        fprintf(stderr, "Cannot connect to X server\n");
+        return -1;
+    }
+
+    Window root = DefaultRootWindow(x_display);
+    x_win = XCreateWindow(x_display, root,
+        0, 0, width, height, 0,
+        CopyFromParent, InputOutput,
+        CopyFromParent, CWEventMask,
+        &win_attr);
+    XMapWindow(x_display, x_win);
+    XStoreName(x_display, x_win, title);
+
+    if (0 != init_egl(with_depth, with_alpha, with_msaa)) return -1;
+    init_blending(with_alpha);
+
+    return init_shaders();
+}
+
+static int init_offscreen(bool with_depth, bool with_alpha, bool with_msaa, int width, int height)
+{
+    egl_display = offscreen_display();
+    if (egl_display == EGL_NO_DISPLAY) return -1;
+
+    if (0 != init_egl_pbuffer(egl_display, EGL_OPENGL_ES_API, EGL_OPENGL_ES3_BIT,
+                              with_depth, with_alpha, with_msaa, width, height,
+                              &egl_surface, &egl_context, gles3_ctxattr)) {
+        return -1;
+    }
+    init_blending(with_alpha);
+
+    return init_shaders();
+}
+
+CAMLprim void gl_exit(void)
+{
+    CAMLparam0();
+
+    glDeleteProgram(flat_program.name);
+    glDeleteProgram(smooth_program.name);
+    eglMakeCurrent(egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    eglDestroyContext(egl_display, egl_context);
+    eglDestroySurface(egl_display, egl_surface);
+    eglTerminate(egl_display);
+    if (! offscreen) {
+        XDestroyWindow(x_display, x_win);
+        XCloseDisplay(x_display);
+    }
+
+    CAMLreturn0;
+}
+
+/*
+ * Clear
+ */
+
+static GLclampf clear_color[4] = { -1., -1., -1., -1. };
+static GLclampf clear_depth = -1.;
+
+static void reset_clear_color(value color)
+{
+    CAMLparam1(color);
+    assert(Is_block(color));
+    assert(Tag_val(color) == Double_array_tag);
+    unsigned const c_dim = Wosize_val(color) / Double_wosize;
+    assert(c_dim == 3 || c_dim == 4);
+    bool changed = false;
+
+    for (unsigned i = 0; i < 4; i++) {
+        GLclampf c;
+        if (i < c_dim) c = Double_field(color, i);
+        else c = i < 3 ? 0. : 1.;
+        if (c != clear_color[i]) {
+            changed = true;
+            clear_color[i] = c;
+        }
+    }
+
+    if (changed) {
+        glClearColor(clear_color[0], clear_color[1], clear_color[2], clear_color[3]);
+    }
+
+    CAMLreturn0;
+}
+
+static void reset_clear_depth(value depth)
+{
+    CAMLparam1(depth);
+
+    GLclampf const d = Double_val(depth);
+    if (d != clear_depth) {
+        clear_depth = d;
+        glClearDepthf(clear_depth);
+    }
+
+    CAMLreturn0;
+}
+
+/*
+ * Buffers
+ */
+
+CAMLprim void gl_swap_buffers(void)
+{
+    delete_dead_objects();
+    frame_stats_before_swap();
+    caml_release_runtime_system();
+    if (double_buffer && ! offscreen) {
+        int res = eglSwapBuffers(egl_display, egl_surface);
+        assert(res == EGL_TRUE);
+    } else {
+        glFlush();
+    }
+    caml_acquire_runtime_system();
+    frame_stats_after_swap();
+    check_frame_errors();
+}
+
+CAMLprim value gl_set_swap_interval(value interval)
+{
+    return Val_bool(eglSwapInterval(egl_display, Int_val(interval)));
+}
+
+/*
+ * Matrices
+ */
+
+static void load_matrix(double const *m)
+{
+    GLfloat *mf = matrices[matrix_mode].m[matrices[matrix_mode].top];
+    for (unsigned i = 0; i < 16; i++) mf[i] = m[i];
+    uniforms_dirty = true;
+}
+
+CAMLprim void gl_set_depth_range(value near, value far)
+{
+    CAMLparam2(near, far);
+
+    glDepthRangef(Double_val(near), Double_val(far));
+
+    check_error();
+    CAMLreturn0;
+}
+
+/*
+ * Rendering
+ */
+
+static GLenum gltype_of_bigarray(struct caml_ba_array const *arr)
+{
+    // GLES has no GL_DOUBLE
+    assert((arr->flags & CAML_BA_KIND_MASK) == CAML_BA_FLOAT32);
+    (void)arr;
+    return GL_FLOAT;
+}
+
+static bool has_uint_indices(void)
+{
+    return true;
+}
+
+static bool has_float_textures(void)
+{
+    static int has_it = -1; // unknown yet
+    if (has_it < 0) has_it = has_extension("GL_OES_texture_float");
+    return has_it;
+}
+
+static void texcoord1_pointer(float const *values, int nb_values)
+{
+    (void)nb_values;
+    sp_tex_coord_pointer(1, GL_FLOAT, 0, values);
+}
+
+static bool has_timer_queries(void)
+{
+    static int has_it = -1;
+    if (has_it < 0) {
+        if (has_extension("GL_EXT_disjoint_timer_query")) {
+            get_query_object_ui64v = (PFNGLGETQUERYOBJECTUI64VEXTPROC)eglGetProcAddress("glGetQueryObjectui64vEXT");
+        }
+        has_it = get_query_object_ui64v != NULL;
+    }
+    return has_it;
+}
+
+static bool has_fences(void)
+{
+    return true;    // core in GLES 3
+}
+
+static bool has_framebuffers(void)
+{
+    return true;
+}
+
+static bool draw_instanced(GLenum mode, value shape, struct caml_ba_array const *offsets, struct caml_ba_array const *scales, value color_specs)
+{
+    CAMLparam2(shape, color_specs);
+    unsigned const v_dim = offsets->dim[1];
+    // The shader offsets and scales only x, y and z
+    if (v_dim > 3) CAMLreturnT(bool, false);
+
+    int const nb_shape = use_vertex_array(shape);
+    int const nb_instances = offsets->dim[0];
+    glVertexAttribPointer(ATTR_OFFSET, v_dim, gltype_of_bigarray(offsets), GL_FALSE, 0, offsets->data);
+    glEnableVertexAttribArray(ATTR_OFFSET);
+    if (scales) {
+        glVertexAttribPointer(ATTR_SCALE, v_dim, gltype_of_bigarray(scales), GL_FALSE, 0, scales->data);
+        glEnableVertexAttribArray(ATTR_SCALE);
+    }
+    // Colors, if an Array, have one row per instance
+    bool const instance_colors = use_color_specs(color_specs) > 0;
+    if (instance_colors) glVertexAttribDivisor(ATTR_COLOR, 1);
+
+    use_program();
+    glDrawArraysInstanced(mode, 0, nb_shape, nb_instances);
+    count_draws(1, (long)nb_shape * nb_instances);
+
+    if (instance_colors) glVertexAttribDivisor(ATTR_COLOR, 0);
+    glDisableVertexAttribArray(ATTR_SCALE);
+    glDisableVertexAttribArray(ATTR_OFFSET);
+    CAMLreturnT(bool, true);
+}
+
+static void multi_draw_arrays(GLenum mode, GLint const *firsts, GLsizei const *counts, GLsizei nb_draws)
+{
+    // No glMultiDrawArrays in GLES 3
+    use_program();
+    for (GLsizei d = 0; d < nb_draws; d++) {
+        if (counts[d] > 0) {
+            glDrawArrays(mode, firsts[d], counts[d]);
+            count_draws(1, counts[d]);
+        }
+    }
+}
+
+static void set_uniq_color(value colors)
+{
+    CAMLparam1(colors);
+    assert(Is_block(colors));
+    assert(Tag_val(colors) == Double_array_tag);
+    unsigned const c_dim = Wosize_val(colors) / Double_wosize;
+    assert(c_dim == 3 || c_dim == 4);
+
+    sp_color4f(
+        Double_field(colors, 0),
+        Double_field(colors, 1),
+        Double_field(colors, 2),
+        c_dim == 4 ? Double_field(colors, 3) : 1.);
+
+    CAMLreturn0;
+}
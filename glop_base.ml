@@ -2,6 +2,13 @@ open Glop_intf
 open Algen_intf
 open Matrix_impl
 
+(* Raised by the C stubs when GL reports an error (if asked to check them) *)
+exception Gl_error of string
+let () = Callback.register_exception "glop_gl_error" (Gl_error "")
+
+(* Matrices are given to GL through such a buffer of 16 floats, column major *)
+type matrix_buffer = (float, Bigarray.float64_elt, Bigarray.c_layout) Bigarray.Array1.t
+
 module type GLOPSPEC =
 sig
     module Dim : CONF_INT
@@ -11,9 +18,16 @@ sig
     type vertex_array
     val make_vertex_array : int -> vertex_array
     val vertex_array_set : vertex_array -> int -> K.t array -> unit
+    val vertex_array_set_coord : vertex_array -> int -> int -> K.t -> unit
     type color_array
     val make_color_array : int -> color_array
     val color_array_set : color_array -> int -> KC.t array -> unit
+    val color_array_set_coord : color_array -> int -> int -> KC.t -> unit
+    type interleaved_array
+    val make_interleaved_array : int -> interleaved_array
+    val interleaved_array_set : interleaved_array -> int -> K.t array -> KC.t array -> unit
+    val blit_matrix : K.t array array -> matrix_buffer -> unit
+    (** [blit_matrix m buf] copies the 4x4 matrix m into buf without allocating *)
 end
 
 module GlopBase
@@ -23,7 +37,8 @@ module GlopBase
               and module K = Spec.K
               and module KC = Spec.KC
               and type vertex_array = Spec.vertex_array
-              and type color_array = Spec.color_array =
+              and type color_array = Spec.color_array
+              and type interleaved_array = Spec.interleaved_array =
 struct
     include Spec
     module M = GlMatrix (K)
@@ -50,26 +65,168 @@ struct
                | UnZoom of int * int * int * int
                | Move   of int * int * int * int
                | Resize of int * int
+               | Key_press of int * int
+               | Key_release of int * int
+               | Enter of int * int
+               | Leave of int * int
+               | Focus of bool
+    type event_buffer = (int, Bigarray.int_elt, Bigarray.c_layout) Bigarray.Array2.t
+    type pixel_array = (int, Bigarray.int8_unsigned_elt, Bigarray.c_layout) Bigarray.Array1.t
+    type error_checks = No_checks | Check_calls | Check_frames
+    type frame_stats =
+        { frame : int ; cpu_time : float ; swap_time : float ; gpu_time : float ;
+          draw_calls : int ; vertices : int }
+    type texture_data = Byte_texels of (int, Bigarray.int8_unsigned_elt, Bigarray.c_layout) Bigarray.Array3.t
+                      | Float_texels of (float, Bigarray.float32_elt, Bigarray.c_layout) Bigarray.Array3.t
+    type texture_filter = Nearest | Linear
+    type texture_wrap = Clamp | Repeat
+    type texcoord_array = (float, Bigarray.float32_elt, Bigarray.c_layout) Bigarray.Array2.t
+    type scalar_array = (float, Bigarray.float32_elt, Bigarray.c_layout) Bigarray.Array1.t
     type render_type = Dot | Line_strip | Line_loop | Lines | Triangle_strip | Triangle_fans | Triangles
     type color_specs = Array of color_array | Uniq of C.t
+    type range_array = (int32, Bigarray.int32_elt, Bigarray.c_layout) Bigarray.Array1.t
+    type index_array = Short_indices of (int, Bigarray.int16_unsigned_elt, Bigarray.c_layout) Bigarray.Array1.t
+                     | Long_indices of (int32, Bigarray.int32_elt, Bigarray.c_layout) Bigarray.Array1.t
 
-    external init            : ?depth:bool -> ?alpha:bool -> ?double_buffer:bool -> ?msaa:bool -> string -> int -> int -> unit = "gl_init_bytecode" "gl_init_native"
+    external init            : ?depth:bool -> ?alpha:bool -> ?double_buffer:bool -> ?msaa:bool -> ?offscreen:bool -> string -> int -> int -> unit = "gl_init_bytecode" "gl_init_native"
     external exit            : unit -> unit = "gl_exit"
+    external set_error_checks : error_checks -> unit = "gl_set_error_checks"
     external next_event      : bool -> event option = "gl_next_event"
+    external next_timed_event : bool -> (event * int) option = "gl_next_timed_event"
+    external poll_events     : bool -> event_buffer -> int = "gl_poll_events"
+    let make_event_buffer n =
+        Bigarray.Array2.create Bigarray.int Bigarray.c_layout n 5
     external clear           : ?color:C.t -> ?depth:K.t -> unit -> unit = "gl_clear"
     external swap_buffers    : unit -> unit = "gl_swap_buffers"
-    external render          : render_type -> vertex_array -> color_specs -> unit = "gl_render"
+    external set_swap_interval : int -> bool = "gl_set_swap_interval"
+
+    external set_frame_stats_ : bool -> unit = "gl_set_frame_stats"
+    let frame_stats_on = ref false
+    let set_frame_stats b =
+        frame_stats_on := b ;
+        set_frame_stats_ b
+    let frame_stats_enabled () = !frame_stats_on
+    external frame_stats     : unit -> frame_stats array = "gl_frame_stats"
+    external frame_clock     : unit -> float = "gl_frame_clock"
+    external frame_draw_calls : unit -> int = "gl_frame_draw_calls"
+    external frame_vertices  : unit -> int = "gl_frame_vertices"
+
+    type pixel_reader
+    external read_pixels     : int -> int -> int -> int -> pixel_array -> unit = "gl_read_pixels"
+    external make_pixel_reader : ?depth:int -> int -> int -> pixel_reader = "gl_make_pixel_reader"
+    external read_pixels_async : pixel_reader -> pixel_array -> bool = "gl_read_pixels_async"
+    external release_pixel_reader : pixel_reader -> unit = "gl_release_pixel_reader"
+
+    type render_target
+    external make_render_target : ?depth:bool -> int -> int -> render_target = "gl_make_render_target"
+    external resize_render_target : render_target -> int -> int -> unit = "gl_resize_render_target"
+    external render_target_size : render_target -> int * int = "gl_render_target_size"
+    external bind_render_target : render_target option -> unit = "gl_bind_render_target"
+    external composite_render_target : render_target -> unit = "gl_composite_render_target"
+    external release_render_target : render_target -> unit = "gl_release_render_target"
+
+
+    type texture
+    external make_texture    : ?filter:texture_filter -> ?wrap:texture_wrap -> texture_data -> texture = "gl_make_texture"
+    external set_texture_params : ?filter:texture_filter -> ?wrap:texture_wrap -> texture -> unit = "gl_set_texture_params"
+    external update_texture  : texture -> int -> int -> texture_data -> unit = "gl_update_texture"
+    external release_texture : texture -> unit = "gl_release_texture"
+
+    let make_texcoord_array len =
+        Bigarray.Array2.create Bigarray.float32 Bigarray.c_layout len 2
+
+    let texcoord_array_set arr i s t =
+        Bigarray.Array2.set arr i 0 s ;
+        Bigarray.Array2.set arr i 1 t
+
+    external render          : ?texture:(texture * texcoord_array) -> render_type -> vertex_array -> color_specs -> unit = "gl_render"
+
+    (* The C side needs to know where vertices stop and colors start: *)
+    external render_interleaved_ : int -> render_type -> interleaved_array -> unit = "gl_render_interleaved"
+    let render_interleaved t arr = render_interleaved_ Dim.v t arr
+
+    (* Indices start at 0, rather than whatever was in memory *)
+    let make_index_array nb_vertices len =
+        if nb_vertices <= 0x10000 then (
+            let a = Bigarray.Array1.create Bigarray.int16_unsigned Bigarray.c_layout len in
+            Bigarray.Array1.fill a 0 ;
+            Short_indices a
+        ) else (
+            let a = Bigarray.Array1.create Bigarray.int32 Bigarray.c_layout len in
+            Bigarray.Array1.fill a 0l ;
+            Long_indices a
+        )
+
+    let index_array_set arr i idx = match arr with
+        | Short_indices a -> Bigarray.Array1.set a i idx
+        | Long_indices a -> Bigarray.Array1.set a i (Int32.of_int idx)
+
+    external render_batch    : render_type -> vertex_array -> color_specs -> range_array -> range_array -> unit = "gl_render_batch"
+    external render_instanced : ?scales:vertex_array -> render_type -> vertex_array -> vertex_array -> color_specs -> unit = "gl_render_instanced"
+
+    let make_palette ?filter colors =
+        let texels = Bigarray.(Array3.create int8_unsigned c_layout 1 (Array.length colors) 4) in
+        Array.iteri (fun i c ->
+            for ch = 0 to 3 do
+                let k = if ch < Array.length c then KC.to_float c.(ch) else 1. in
+                texels.{0, i, ch} <- max 0 (min 255 (int_of_float (k *. 255. +. 0.5)))
+            done) colors ;
+        make_texture ?filter (Byte_texels texels)
+
+    external render_mapped   : ?range:(float * float) -> render_type -> vertex_array -> texture -> scalar_array -> unit = "gl_render_mapped"
+    external render_indexed  : render_type -> vertex_array -> color_specs -> index_array -> unit = "gl_render_indexed"
+
+    type buffer
+    external make_buffer     : ?colors:color_array -> vertex_array -> buffer = "gl_make_buffer"
+    external update_buffer   : ?first:int -> ?colors:color_array -> buffer -> vertex_array -> unit = "gl_update_buffer"
+    external render_buffer   : ?color:C.t -> render_type -> buffer -> unit = "gl_render_buffer"
+    external release_buffer  : buffer -> unit = "gl_release_buffer"
+    external make_interleaved_buffer_ : int -> interleaved_array -> buffer = "gl_make_interleaved_buffer"
+    let make_interleaved_buffer arr = make_interleaved_buffer_ Dim.v arr
+    external update_interleaved_buffer : ?first:int -> buffer -> interleaved_array -> unit = "gl_update_interleaved_buffer"
+
+    type gl_stream
+    type stream = { gl_stream : gl_stream ; staging : vertex_array }
+    external make_stream_    : ?depth:int -> vertex_array -> gl_stream = "gl_make_stream"
+    let make_stream ?depth n =
+        let staging = make_vertex_array n in
+        { gl_stream = make_stream_ ?depth staging ; staging }
+    let stream_vertices s = s.staging
+    external render_stream_  : ?count:int -> ?color:C.t -> render_type -> gl_stream -> vertex_array -> unit = "gl_render_stream"
+    let render_stream ?count ?color render_type s =
+        render_stream_ ?count ?color render_type s.gl_stream s.staging
+    external release_stream_ : gl_stream -> unit = "gl_release_stream"
+    let release_stream s = release_stream_ s.gl_stream
 
     (* Regardless of K and M that we use for geometry, gl_set_projection/gl_set_modelview
-     * expect a float matrix: *)
-    external set_projection_ : M.MFloat.t -> unit = "gl_set_projection"
-    external set_modelview_  : M.MFloat.t -> unit = "gl_set_modelview"
-    let set_projection m = set_projection_ (M.to_float m)
-    let set_modelview m = set_modelview_ (M.to_float m)
+     * expect a float matrix, that we copy in this buffer to spare allocations: *)
+    let matrix_buffer : matrix_buffer =
+        Bigarray.Array1.create Bigarray.float64 Bigarray.c_layout 16
+    external set_projection_ : matrix_buffer -> unit = "gl_set_projection"
+    external set_modelview_  : matrix_buffer -> unit = "gl_set_modelview"
+    let set_projection m = blit_matrix m matrix_buffer ; set_projection_ matrix_buffer
+    let set_modelview m = blit_matrix m matrix_buffer ; set_modelview_ matrix_buffer
 
     external set_viewport    : int -> int -> int -> int -> unit = "gl_set_viewport"
     external set_scissor     : int -> int -> int -> int -> unit = "gl_set_scissor"
     external disable_scissor : unit -> unit = "gl_disable_scissor"
     external set_depth_range : K.t -> K.t -> unit = "gl_set_depth_range"
     external window_size     : unit -> int * int = "gl_window_size"
+
+    let event_of_row buf i =
+        let x = buf.{i, 1} and y = buf.{i, 2} and shifted = buf.{i, 3} land 1 <> 0 in
+        let w, h = window_size () in
+        match buf.{i, 0} with
+        | 0 -> Clic (x, y, w, h, shifted)
+        | 1 -> UnClic (x, y, w, h)
+        | 2 -> Zoom (x, y, w, h, shifted)
+        | 3 -> UnZoom (x, y, w, h)
+        | 4 -> Move (x, y, w, h)
+        | 5 -> Resize (x, y)
+        | 6 -> Key_press (x, y)
+        | 7 -> Key_release (x, y)
+        | 8 -> Enter (x, y)
+        | 9 -> Leave (x, y)
+        | 10 -> Focus shifted
+        | _ -> invalid_arg "event_of_row"
 end
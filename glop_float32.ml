@@ -0,0 +1,16 @@
+(* Same as Glop_impl instances but with single precision vertex and color
+ * arrays (only available with the desktop GL backend). *)
+open Glop_intf
+open Algen_intf
+
+module Make (Dim : CONF_INT) (CDim: CONF_INT) :
+    GLOP with module V.Dim = Dim
+         and module C.Dim = CDim
+         and module K = Glop_spec.K =
+    Glop_impl.MakeCustom (Glop_spec.Spec32 (Dim) (CDim))
+
+open Algen_impl
+module Glop2D = Make (Dim2) (Dim3)
+module Glop3D = Make (Dim3) (Dim3)
+module Glop2Dalpha = Make (Dim2) (Dim4)
+module Glop3Dalpha = Make (Dim3) (Dim4)
@@ -2,11 +2,27 @@ open Glop_intf
 open Glop_base
 open Algen_intf
 
-module Extension (GB : CORE_GLOP) =
+module type MATRIX_STACKS =
+sig
+    type matrix
+    val set_projection  : matrix -> unit
+    val set_modelview   : matrix -> unit
+    val mult_projection : matrix -> unit
+    val push_projection : unit -> unit
+    val pop_projection  : unit -> unit
+    val get_projection  : unit -> matrix
+    val mult_modelview  : matrix -> unit
+    val push_modelview  : unit -> unit
+    val pop_modelview   : unit -> unit
+    val get_modelview   : unit -> matrix
+end
+
+(* Matrix stacks as OCaml lists *)
+module Stacks (GB : CORE_GLOP) : MATRIX_STACKS with type matrix = GB.M.t =
 struct
+    type matrix = GB.M.t
     let proj_stack = ref [ GB.M.id ]
     let model_stack  = ref [ GB.M.id ]
-    let last_viewport   = ref (0, 0, 0, 0)
 
     (* Set current matrix to the top of the stack *)
     let set_proj ()  = GB.set_projection (List.hd !proj_stack)
@@ -23,6 +39,47 @@ struct
     let mult_modelview m   = set_modelview  (GB.M.mul_mat (List.hd !model_stack) m)
     let get_projection ()  = List.hd !proj_stack
     let get_modelview ()   = List.hd !model_stack
+end
+
+(* Matrix stacks kept in C, where matrices are pushed, popped and multiplied
+ * in place (with SIMD instructions when available), so that only get_projection
+ * and get_modelview allocate. *)
+module NativeStacks (Spec : GLOPSPEC) (GB : CORE_GLOP with module K = Spec.K) :
+    MATRIX_STACKS with type matrix = GB.M.t =
+struct
+    type matrix = GB.M.t
+    type stack = Projection | Modelview (* same order as C matrix_stacks *)
+
+    external stack_load : stack -> matrix_buffer -> unit = "gl_stack_load"
+    external stack_mult : stack -> matrix_buffer -> unit = "gl_stack_mult"
+    external stack_push : stack -> unit = "gl_stack_push"
+    external stack_pop  : stack -> unit = "gl_stack_pop"
+    external stack_get  : stack -> matrix_buffer -> unit = "gl_stack_get"
+
+    let buf : matrix_buffer = Bigarray.Array1.create Bigarray.float64 Bigarray.c_layout 16
+
+    let load stack m = Spec.blit_matrix m buf ; stack_load stack buf
+    let mult stack m = Spec.blit_matrix m buf ; stack_mult stack buf
+    let get stack =
+        stack_get stack buf ;
+        Array.init 4 (fun c -> Array.init 4 (fun r -> GB.K.of_float buf.{c*4 + r}))
+
+    let set_projection m   = load Projection m
+    let set_modelview m    = load Modelview m
+    let push_projection () = stack_push Projection
+    let push_modelview ()  = stack_push Modelview
+    let pop_projection ()  = stack_pop Projection
+    let pop_modelview ()   = stack_pop Modelview
+    let mult_projection m  = mult Projection m
+    let mult_modelview m   = mult Modelview m
+    let get_projection ()  = get Projection
+    let get_modelview ()   = get Modelview
+end
+
+module ExtensionWithStacks (GB : CORE_GLOP) (S : MATRIX_STACKS with type matrix = GB.M.t) =
+struct
+    include S
+    let last_viewport   = ref (0, 0, 0, 0)
 
     (* For viewport we merely store the current value *)
     let set_viewport x y w h =
@@ -31,6 +88,23 @@ struct
 
     let get_viewport () = !last_viewport
 
+    let current_target = ref None
+
+    let draw_into target f =
+        let prev_target = !current_target
+        and (x, y, w, h) = !last_viewport in
+        let restore () =
+            current_target := prev_target ;
+            GB.bind_render_target prev_target ;
+            set_viewport x y w h in
+        current_target := Some target ;
+        GB.bind_render_target !current_target ;
+        let tw, th = GB.render_target_size target in
+        set_viewport 0 0 tw th ;
+        (try f ()
+        with e -> restore () ; raise e) ;
+        restore ()
+
     let vertex_array_init len f =
         let arr = GB.make_vertex_array len in
         for c = 0 to len-1 do
@@ -45,6 +119,16 @@ struct
         done ;
         arr
 
+    let vertex_array_fill len f =
+        let arr = GB.make_vertex_array len in
+        f arr 0 len ;
+        arr
+
+    let color_array_fill len f =
+        let arr = GB.make_color_array len in
+        f arr 0 len ;
+        arr
+
     let set_projection_to_winsize get_projection w h =
         if w > 0 && h > 0 then (
             let x, y =
@@ -100,6 +184,8 @@ struct
         Array.sub v 0 GB.V.Dim.v
 end
 
+module Extension (GB : CORE_GLOP) = ExtensionWithStacks (GB) (Stacks (GB))
+
 module MakeCustom (Spec : GLOPSPEC) :
     GLOP with module V.Dim = Spec.Dim
          and module C.Dim = Spec.CDim
@@ -116,6 +202,23 @@ module Make (Dim : CONF_INT) (CDim: CONF_INT) :
          and module K = Glop_spec.K =
     MakeCustom (Glop_spec.Spec (Dim) (CDim))
 
+(* Same as above, with the matrix stacks in C *)
+module MakeCustomNative (Spec : GLOPSPEC) :
+    GLOP with module V.Dim = Spec.Dim
+         and module C.Dim = Spec.CDim
+         and module K = Spec.K =
+struct
+    module GB = GlopBase (Spec)
+    include GB
+    include ExtensionWithStacks (GB) (NativeStacks (Spec) (GB))
+end
+
+module MakeNative (Dim : CONF_INT) (CDim: CONF_INT) :
+    GLOP with module V.Dim = Dim
+         and module C.Dim = CDim
+         and module K = Glop_spec.K =
+    MakeCustomNative (Glop_spec.Spec (Dim) (CDim))
+
 open Algen_impl
 module Glop2D = Make (Dim2) (Dim3)
 module Glop3D = Make (Dim3) (Dim3)
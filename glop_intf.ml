@@ -46,11 +46,24 @@ sig
 
     (** Init *)
 
-    (* raises Failure when no visual match the requested specs *)
+    (* raises Failure when no visual match the requested specs.
+     * With ~offscreen:true no window is opened; rendering goes to an
+     * offscreen EGL surface of the given size instead (which works without X
+     * nor GPU with Mesa), and there are no events. *)
     val init : ?depth:bool -> ?alpha:bool -> ?double_buffer:bool ->
-               ?msaa:bool -> string -> int -> int -> unit
+               ?msaa:bool -> ?offscreen:bool -> string -> int -> int -> unit
     val exit : unit -> unit
 
+    (** Errors *)
+
+    type error_checks = No_checks | Check_calls | Check_frames
+    (** Asking GL for errors may stall the rendering pipeline, so errors are
+     * not checked by default (No_checks). Check_calls checks for errors
+     * after every call, while Check_frames checks only once per frame, in
+     * [swap_buffers]. Errors are reported by raising Glop_base.Gl_error. *)
+
+    val set_error_checks : error_checks -> unit
+
     (** Events *)
 
     type event = Clic   of int * int * int * int * bool
@@ -59,10 +72,40 @@ sig
                | UnZoom of int * int * int * int
                | Move   of int * int * int * int
                | Resize of int * int
-    (* Clic (x, y, width, height), Resize (width, height) *)
+               | Key_press of int * int
+               | Key_release of int * int
+               | Enter of int * int
+               | Leave of int * int
+               | Focus of bool
+    (* Clic (x, y, width, height), Resize (width, height),
+     * Key_press (keysym, modifiers) with X keysyms and modifier masks,
+     * Enter (x, y), Focus has_focus *)
 
     val next_event : bool -> event option
 
+    val next_timed_event : bool -> (event * int) option
+    (** Same as [next_event] but also returns the X server time of the event,
+     * in milliseconds (events without time get the time of the previous
+     * one). *)
+
+    type event_buffer = (int, Bigarray.int_elt, Bigarray.c_layout) Bigarray.Array2.t
+    (** Rows of 5 ints: the index of the event constructor (0 for Clic to 10
+     * for Focus), its 2 ints (x, y, or width, height, or keysym, modifiers),
+     * flags (1 if shifted or focused) and the X server time in
+     * milliseconds. *)
+
+    val make_event_buffer : int -> event_buffer
+    (** [make_event_buffer n] returns a buffer for n events. *)
+
+    val poll_events : bool -> event_buffer -> int
+    (** [poll_events wait buf] fills buf with all pending events (waiting for
+     * one if wait) and returns how many rows were filled, without allocating
+     * anything. Move events are compressed as with [next_event]. *)
+
+    val event_of_row : event_buffer -> int -> event
+    (** [event_of_row buf i] returns the event of row i, with the current
+     * window size. *)
+
     (** Clear *)
 
     val clear : ?color:C.t -> ?depth:K.t -> unit -> unit
@@ -71,6 +114,92 @@ sig
 
     val swap_buffers : unit -> unit
 
+    val set_swap_interval : int -> bool
+    (** [set_swap_interval n] makes [swap_buffers] wait for n vertical
+     * retraces (0 to not wait for vsync). Returns false if not supported. *)
+
+    (** Frame statistics *)
+
+    type frame_stats =
+        { frame : int ;         (** Frame number since stats were enabled *)
+          cpu_time : float ;    (** Seconds from the previous swap to this one *)
+          swap_time : float ;   (** Seconds spent in [swap_buffers] *)
+          gpu_time : float ;    (** Seconds spent by the GPU, or nan if unknown
+                                 * (also after a GPU disjoint event) *)
+          draw_calls : int ;
+          vertices : int }
+
+    val set_frame_stats : bool -> unit
+    (** Starts or stops collecting frame statistics (off by default). GPU
+     * times need timer queries (not available on GLES 1) and are read back
+     * a few frames later, without waiting for the GPU. *)
+
+    val frame_stats_enabled : unit -> bool
+
+    val frame_stats : unit -> frame_stats array
+    (** Statistics of the last 64 frames, oldest first. *)
+
+    val frame_clock : unit -> float
+    (** The monotonic clock used for frame statistics, in seconds. *)
+
+    val frame_draw_calls : unit -> int
+    val frame_vertices : unit -> int
+    (** Draw calls and vertices submitted so far during the current frame. *)
+
+    (** Reading pixels back *)
+
+    type pixel_array = (int, Bigarray.int8_unsigned_elt, Bigarray.c_layout) Bigarray.Array1.t
+    (** RGBA pixels, 4 bytes per pixel, rows from bottom to top. *)
+
+    val read_pixels : int -> int -> int -> int -> pixel_array -> unit
+    (** [read_pixels x y w h pixels] copies the pixels of the rectangle which
+     * lower left corner is at x, y and size is w, h into pixels (which must be
+     * large enough), waiting for the GPU to complete the frame. Call it
+     * before [swap_buffers]. *)
+
+    type pixel_reader
+    (** A [pixel_reader] reads frames without waiting for the GPU, by copying
+     * each frame only when the next ones are being read. *)
+
+    val make_pixel_reader : ?depth:int -> int -> int -> pixel_reader
+    (** [make_pixel_reader w h] returns a reader for the w x h lower left
+     * pixels of the frame, with depth (default 3) frames in flight. *)
+
+    val read_pixels_async : pixel_reader -> pixel_array -> bool
+    (** [read_pixels_async reader pixels] starts reading the current frame
+     * (call it before [swap_buffers]) and copies the frame started depth-1
+     * calls ago into pixels. Returns false if there were no such frame yet.
+     * (On GLES 1, it reads the current frame synchronously.) *)
+
+    val release_pixel_reader : pixel_reader -> unit
+
+    (** Render targets *)
+
+    type render_target
+    (** An offscreen framebuffer with a color texture and an optional depth
+     * buffer, to render a view once and composite it every frame. *)
+
+    val make_render_target : ?depth:bool -> int -> int -> render_target
+    (** [make_render_target w h] returns a w x h render target, with a depth
+     * buffer if depth (default false). On GLES 1, w and h may have to be
+     * powers of 2. *)
+
+    val resize_render_target : render_target -> int -> int -> unit
+    (** The previous content is lost. *)
+
+    val render_target_size : render_target -> int * int
+
+    val bind_render_target : render_target option -> unit
+    (** [bind_render_target (Some t)] makes following calls draw into t,
+     * while [bind_render_target None] goes back to the window. The viewport
+     * is left untouched (see [draw_into]). *)
+
+    val composite_render_target : render_target -> unit
+    (** [composite_render_target t] draws the content of t over the whole
+     * current viewport (blended if blending is enabled). *)
+
+    val release_render_target : render_target -> unit
+
     (** Geometry arrays *)
 
     type vertex_array
@@ -83,6 +212,10 @@ sig
 
     val vertex_array_set : vertex_array -> int -> V.t -> unit
 
+    val vertex_array_set_coord : vertex_array -> int -> int -> K.t -> unit
+    (** [vertex_array_set_coord arr i c k] sets the coordinate c of vertex i
+     * to k, without allocating a vector. *)
+
     type color_array
     (** [color_array] is a bigarray of some sort (floats or nativeints), with 2
      * dimensions, the second one being the same as that of C. *)
@@ -93,10 +226,157 @@ sig
 
     val color_array_set : color_array -> int -> C.t -> unit
 
+    val color_array_set_coord : color_array -> int -> int -> KC.t -> unit
+
+    type interleaved_array
+    (** [interleaved_array] is a bigarray of the same sort, which rows are made
+     * of a vertex followed by its color, so that each vertex is stored in a
+     * single contiguous region. *)
+
+    val make_interleaved_array : int -> interleaved_array
+    (** [make_interleaved_array len] build an uninitialized interleaved array
+     * with room for len vertices and their colors *)
+
+    val interleaved_array_set : interleaved_array -> int -> V.t -> C.t -> unit
+
+    (** Textures *)
+
+    type texture_data = Byte_texels of (int, Bigarray.int8_unsigned_elt, Bigarray.c_layout) Bigarray.Array3.t
+                      | Float_texels of (float, Bigarray.float32_elt, Bigarray.c_layout) Bigarray.Array3.t
+    (** Texels, indexed by row (from bottom to top), column and channel.
+     * 1 channel is luminance, 2 luminance and alpha, 3 RGB and 4 RGBA.
+     * Float_texels are not supported by GLES 1. *)
+
+    type texture_filter = Nearest | Linear
+    type texture_wrap = Clamp | Repeat
+
+    type texture
+
+    val make_texture : ?filter:texture_filter -> ?wrap:texture_wrap -> texture_data -> texture
+    (** [make_texture data] uploads data (without copying it first) into a new
+     * texture. Default filter is Linear and default wrap is Clamp. *)
+
+    val set_texture_params : ?filter:texture_filter -> ?wrap:texture_wrap -> texture -> unit
+    (** Changes only the given parameters. *)
+
+    val update_texture : texture -> int -> int -> texture_data -> unit
+    (** [update_texture tex x y data] overwrites the part of tex which lower
+     * left corner is at x, y with data, which must have the same kind and
+     * number of channels. *)
+
+    val release_texture : texture -> unit
+
+    type texcoord_array = (float, Bigarray.float32_elt, Bigarray.c_layout) Bigarray.Array2.t
+    (** One (s, t) pair of texture coordinates per vertex. *)
+
+    val make_texcoord_array : int -> texcoord_array
+    val texcoord_array_set : texcoord_array -> int -> float -> float -> unit
+
     type render_type = Dot | Line_strip | Line_loop | Lines | Triangle_strip | Triangle_fans | Triangles
     type color_specs = Array of color_array | Uniq of C.t
 
-    val render : render_type -> vertex_array -> color_specs -> unit
+    val render : ?texture:(texture * texcoord_array) -> render_type -> vertex_array -> color_specs -> unit
+    (** When given a texture, the texels are modulated by the colors (use
+     * white to get the texture unchanged). *)
+
+    val render_interleaved : render_type -> interleaved_array -> unit
+
+    type range_array = (int32, Bigarray.int32_elt, Bigarray.c_layout) Bigarray.Array1.t
+
+    val render_batch : render_type -> vertex_array -> color_specs -> range_array -> range_array -> unit
+    (** [render_batch t vertices colors firsts counts] renders, in a single
+     * call, as many primitives as there are entries in firsts and counts,
+     * the ith one being made of the counts.{i} vertices starting at index
+     * firsts.{i}. *)
+
+    val render_instanced : ?scales:vertex_array -> render_type -> vertex_array -> vertex_array -> color_specs -> unit
+    (** [render_instanced t shape offsets colors] renders one copy of shape
+     * per row of offsets, translated by that offset and, if scales is given,
+     * first scaled by the corresponding row of scales. colors, if an Array,
+     * gives one color per instance. All copies are rendered in a single call,
+     * with per-instance attributes where the backend has shaders, otherwise
+     * expanded on the CPU. *)
+
+    (** Color mapping *)
+
+    type scalar_array = (float, Bigarray.float32_elt, Bigarray.c_layout) Bigarray.Array1.t
+
+    val make_palette : ?filter:texture_filter -> C.t array -> texture
+    (** [make_palette colors] returns a texture made of the given colors, to
+     * be used with [render_mapped]. With filter Linear (the default) values
+     * between two colors are interpolated. *)
+
+    val render_mapped : ?range:(float * float) -> render_type -> vertex_array -> texture -> scalar_array -> unit
+    (** [render_mapped t vertices palette values] renders the vertices, the
+     * color of each being given by looking up its value in palette, range
+     * (default (0., 1.)) spanning from the first to the last color. The
+     * mapping is done by GL so changing the range is free. *)
+
+    type index_array = Short_indices of (int, Bigarray.int16_unsigned_elt, Bigarray.c_layout) Bigarray.Array1.t
+                     | Long_indices of (int32, Bigarray.int32_elt, Bigarray.c_layout) Bigarray.Array1.t
+    (** Indices of vertices in a vertex_array. Long_indices may not be
+     * supported by all GLES implementations. *)
+
+    val make_index_array : int -> int -> index_array
+    (** [make_index_array nb_vertices len] build an index array of zeros
+     * with room for len indices, using the smallest type able to index
+     * nb_vertices vertices. *)
+
+    val index_array_set : index_array -> int -> int -> unit
+
+    val render_indexed : render_type -> vertex_array -> color_specs -> index_array -> unit
+    (** [render_indexed t vertices colors indices] renders the vertices (which
+     * colors have the same indices) in the order given by indices. Raises
+     * Failure if the indices are too large for this GL implementation. *)
+
+    (** Buffer objects *)
+
+    type buffer
+    (** [buffer] is a copy of a vertex_array (and optionally of a color_array
+     * of same length) uploaded once into GL buffer objects, so that rendering
+     * it does not need to transfer the vertices again. Buffers are released
+     * when garbage collected, but you'd rather release them explicitly. *)
+
+    val make_buffer : ?colors:color_array -> vertex_array -> buffer
+
+    val update_buffer : ?first:int -> ?colors:color_array -> buffer -> vertex_array -> unit
+    (** [update_buffer buf vertices] replaces the content of buf with vertices
+     * (and colors, if given, or no colors otherwise).
+     * [update_buffer ~first buf vertices] overwrites only the vertices (and
+     * colors, if given) starting at index first, leaving the others untouched.
+     * Raises Invalid_argument if they do not fit. *)
+
+    val render_buffer : ?color:C.t -> render_type -> buffer -> unit
+    (** [render_buffer buf] renders buf using its own colors, unless [color]
+     * is given. *)
+
+    val make_interleaved_buffer : interleaved_array -> buffer
+
+    val update_interleaved_buffer : ?first:int -> buffer -> interleaved_array -> unit
+    (** Same as [update_buffer] for buffers made with [make_interleaved_buffer]. *)
+
+    val release_buffer : buffer -> unit
+    (** [release_buffer buf] frees the GL resources of buf, which must not be
+     * used anymore. *)
+
+    type stream
+    (** A [stream] is a buffer object for vertices rewritten every frame. It
+     * is split into depth regions written in turn, so that writing the next
+     * frame never waits for the GPU to be done with the previous ones. *)
+
+    val make_stream : ?depth:int -> int -> stream
+    (** [make_stream n] returns a stream of depth (default 3) regions of n
+     * vertices. (On GLES 1, there is a single region.) *)
+
+    val stream_vertices : stream -> vertex_array
+    (** [stream_vertices s] returns the n vertices to be written before each
+     * [render_stream]. It's always the same array. *)
+
+    val render_stream : ?count:int -> ?color:C.t -> render_type -> stream -> unit
+    (** [render_stream s] copies the count first vertices (default all) of
+     * [stream_vertices s] into the next region of s and renders them. *)
+
+    val release_stream : stream -> unit
 
     (** Matrices *)
 
@@ -127,9 +407,20 @@ sig
     val get_modelview   : unit -> M.t
     val get_viewport    : unit -> (int * int * int * int)
 
+    val draw_into : render_target -> (unit -> unit) -> unit
+    (** [draw_into t f] calls f with t bound and the viewport set to cover
+     * it, then restores the previous target and viewport. *)
+
     val vertex_array_init : int -> (int -> V.t) -> vertex_array
     val color_array_init  : int -> (int -> C.t) -> color_array
 
+    val vertex_array_fill : int -> (vertex_array -> int -> int -> unit) -> vertex_array
+    val color_array_fill  : int -> (color_array -> int -> int -> unit) -> color_array
+    (** [vertex_array_fill len f] returns a vertex array of len vertices set
+     * by [f arr first last], which must set the vertices first to last-1
+     * (with [vertex_array_set_coord]). Glop_parallel has versions that call
+     * f on slices in several domains. *)
+
     val set_projection_to_winsize : (K.t -> K.t -> M.t) -> int -> int -> unit
     (** Helper function to reset the projection matrix to maintain constant aspect ratio of 1
      * after the window is resized.
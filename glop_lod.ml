@@ -0,0 +1,183 @@
+open Glop_intf
+
+(* Level of detail for long series of samples (time series, or point clouds
+ * sorted by x), so that drawing them costs according to the screen width
+ * rather than the number of samples.
+ * Above the samples, each level of a min/max pyramid keeps the min and max y
+ * of buckets of factor times more samples than the level below. Rendering
+ * picks the finest level with at most density buckets per pixel column of
+ * the visible x range, and draws each bucket as its min then its max. *)
+
+(* The pyramid itself, which needs no GL *)
+
+type level = {
+    mutable mins : float array ;
+    mutable maxs : float array }
+
+type series = {
+    factor : int ;
+    mutable xs : float array ;  (* must be non decreasing *)
+    mutable ys : float array ;
+    mutable length : int ;
+    (* levels.(k) has buckets of factor^(k+1) samples *)
+    mutable levels : level array }
+
+let make_series ?(factor=4) () =
+    if factor < 2 then invalid_arg "Glop_lod.make" ;
+    { factor ; xs = [||] ; ys = [||] ; length = 0 ; levels = [||] }
+
+let rec pow n k = if k = 0 then 1 else n * pow n (k-1)
+
+let bucket_size s k = pow s.factor (k+1)
+
+let grow arr len =
+    if len <= Array.length arr then arr else (
+        let arr' = Array.make (max len (2 * Array.length arr)) 0. in
+        Array.blit arr 0 arr' 0 (Array.length arr) ;
+        arr'
+    )
+
+(* A level is only worth having once it has at least two buckets. It's
+ * then computed from the level below, and updated at each append. *)
+let add_level s =
+    let k = Array.length s.levels in
+    let size = bucket_size s k in
+    let nb_buckets = (s.length + size - 1) / size in
+    let mins = Array.make nb_buckets infinity
+    and maxs = Array.make nb_buckets neg_infinity in
+    let below_mins, below_maxs, below_len =
+        if k = 0 then s.ys, s.ys, s.length else
+        let l = s.levels.(k-1) in
+        l.mins, l.maxs, (s.length + size / s.factor - 1) / (size / s.factor) in
+    for i = 0 to below_len - 1 do
+        let b = i / s.factor in
+        mins.(b) <- min mins.(b) below_mins.(i) ;
+        maxs.(b) <- max maxs.(b) below_maxs.(i)
+    done ;
+    s.levels <- Array.append s.levels [| { mins ; maxs } |]
+
+(* [append_sample s x y] adds a sample, whose x must not be less than the
+ * previous one. *)
+let append_sample s x y =
+    if s.length > 0 && x < s.xs.(s.length - 1) then invalid_arg "Glop_lod.append" ;
+    let n = s.length in
+    s.xs <- grow s.xs (n + 1) ;
+    s.ys <- grow s.ys (n + 1) ;
+    s.xs.(n) <- x ;
+    s.ys.(n) <- y ;
+    s.length <- n + 1 ;
+    Array.iteri (fun k l ->
+        let size = bucket_size s k in
+        let b = n / size in
+        if n mod size = 0 then (
+            l.mins <- grow l.mins (b + 1) ;
+            l.maxs <- grow l.maxs (b + 1) ;
+            l.mins.(b) <- y ;
+            l.maxs.(b) <- y
+        ) else (
+            l.mins.(b) <- min l.mins.(b) y ;
+            l.maxs.(b) <- max l.maxs.(b) y
+        )) s.levels ;
+    if s.length >= 2 * bucket_size s (Array.length s.levels) then add_level s
+
+(* Index of the first sample which x is not less than x (or length) *)
+let search_series s x =
+    let rec aux lo hi =
+        if lo >= hi then lo else
+        let mid = (lo + hi) / 2 in
+        if s.xs.(mid) < x then aux (mid + 1) hi else aux lo mid in
+    aux 0 s.length
+
+(* Range of the samples which x is projected to a * x + b within -1..1,
+ * with one more sample on each side so that lines go out of the screen. *)
+let projected_range s a b =
+    if a = 0. then 0, s.length - 1 else
+    let x0 = (-1. -. b) /. a and x1 = (1. -. b) /. a in
+    max 0 (search_series s (min x0 x1) - 1),
+    min (s.length - 1) (search_series s (max x0 x1))
+
+(* The finest level with at most max_buckets buckets for nb_samples, or the
+ * coarsest one if none has so few, or -1 if samples can be drawn as is. *)
+let pick_level s nb_samples max_buckets =
+    let nb_levels = Array.length s.levels in
+    let rec aux k =
+        if k >= nb_levels - 1 ||
+           nb_samples / bucket_size s k <= max_buckets then k
+        else aux (k + 1) in
+    if nb_samples <= max_buckets || nb_levels = 0 then -1 else aux 0
+
+module Make (Glop : GLOP) =
+struct
+    open Glop
+
+    type t = {
+        series : series ;
+        mutable stream : (stream * int) option } (* with its size *)
+
+    let make ?factor () =
+        { series = make_series ?factor () ; stream = None }
+
+    let length t = t.series.length
+
+    let append t x y = append_sample t.series x y
+
+    let search t x = search_series t.series x
+
+    (* Range of the samples visible with the current projection, modelview
+     * and viewport (assuming x is not rotated), with one more sample on
+     * each side so that lines go out of the screen. *)
+    let visible_range t =
+        let m = M.mul_mat (get_projection ()) (get_modelview ()) in
+        projected_range t.series (K.to_float m.(0).(0)) (K.to_float m.(3).(0))
+
+    let vertex x y =
+        Array.init V.Dim.v (fun i ->
+            if i = 0 then K.of_float x else
+            if i = 1 then K.of_float y else K.zero)
+
+    (* Vertices are written in a stream large enough for the screen *)
+    let get_stream t nb_vertices =
+        match t.stream with
+        | Some (s, size) when size >= nb_vertices -> s
+        | prev ->
+            (match prev with Some (s, _) -> release_stream s | None -> ()) ;
+            let size = max 1024 (2 * nb_vertices) in
+            let s = make_stream size in
+            t.stream <- Some (s, size) ;
+            s
+
+    (* [render t] draws the visible samples of t with at most density
+     * (default 2) buckets per pixel column. *)
+    let render ?(density=2) ?color render_type t =
+        let series = t.series in
+        if series.length > 0 then (
+            let first, last = visible_range t in
+            let _, _, w, _ = get_viewport () in
+            let nb_samples = last - first + 1 in
+            let k = pick_level series nb_samples (max 1 (density * w)) in
+            if k < 0 then (
+                let s = get_stream t nb_samples in
+                let vertices = stream_vertices s in
+                for i = first to last do
+                    vertex_array_set vertices (i - first) (vertex series.xs.(i) series.ys.(i))
+                done ;
+                render_stream ~count:nb_samples ?color render_type s
+            ) else (
+                let size = bucket_size series k and l = series.levels.(k) in
+                let b0 = first / size and b1 = last / size in
+                let nb_vertices = 2 * (b1 - b0 + 1) in
+                let s = get_stream t nb_vertices in
+                let vertices = stream_vertices s in
+                for b = b0 to b1 do
+                    let x = series.xs.(b * size) in
+                    vertex_array_set vertices (2 * (b - b0)) (vertex x l.mins.(b)) ;
+                    vertex_array_set vertices (2 * (b - b0) + 1) (vertex x l.maxs.(b))
+                done ;
+                render_stream ~count:nb_vertices ?color render_type s
+            )
+        )
+
+    let release t =
+        (match t.stream with Some (s, _) -> release_stream s | None -> ()) ;
+        t.stream <- None
+end
@@ -0,0 +1,125 @@
+open Glop_intf
+
+(* Filling large arrays with several domains (OCaml >= 5 only).
+ * A pool keeps its domains waiting for jobs. A job is split into chunks of
+ * rows, that the domains (including the caller's) take in turn from a shared
+ * counter until there are none left, so that faster domains do more. *)
+
+type job = {
+    run : int -> int -> unit ;
+    length : int ;
+    chunk : int ;
+    nb_chunks : int ;
+    next_chunk : int Atomic.t ;
+    done_chunks : int Atomic.t ;
+    error : exn option Atomic.t }
+
+type pool = {
+    mutex : Mutex.t ;
+    new_job : Condition.t ;
+    job_done : Condition.t ;
+    mutable job : job option ;
+    mutable generation : int ; (* incremented for each job *)
+    mutable stopping : bool ;
+    mutable domains : unit Domain.t list }
+
+let work pool job =
+    let rec loop () =
+        let c = Atomic.fetch_and_add job.next_chunk 1 in
+        if c < job.nb_chunks then (
+            let first = c * job.chunk in
+            (try job.run first (min job.length (first + job.chunk))
+            with e -> ignore (Atomic.compare_and_set job.error None (Some e))) ;
+            if Atomic.fetch_and_add job.done_chunks 1 = job.nb_chunks - 1 then (
+                Mutex.lock pool.mutex ;
+                Condition.broadcast pool.job_done ;
+                Mutex.unlock pool.mutex) ;
+            loop ()) in
+    loop ()
+
+let rec worker pool generation =
+    Mutex.lock pool.mutex ;
+    while pool.generation = generation && not pool.stopping do
+        Condition.wait pool.new_job pool.mutex
+    done ;
+    let stopping = pool.stopping
+    and generation = pool.generation
+    and job = pool.job in
+    Mutex.unlock pool.mutex ;
+    if not stopping then (
+        (match job with Some job -> work pool job | None -> ()) ;
+        worker pool generation)
+
+(* [make_pool n] starts n domains (default: one less than the recommended
+ * count, since the caller works too). *)
+let make_pool ?domains () =
+    let n = match domains with
+        | Some n -> n
+        | None -> Domain.recommended_domain_count () - 1 in
+    let pool =
+        { mutex = Mutex.create () ; new_job = Condition.create () ;
+          job_done = Condition.create () ; job = None ; generation = 0 ;
+          stopping = false ; domains = [] } in
+    pool.domains <- List.init (max 0 n) (fun _ -> Domain.spawn (fun () -> worker pool 0)) ;
+    pool
+
+let release_pool pool =
+    Mutex.lock pool.mutex ;
+    pool.stopping <- true ;
+    Condition.broadcast pool.new_job ;
+    Mutex.unlock pool.mutex ;
+    List.iter Domain.join pool.domains ;
+    pool.domains <- []
+
+(* [parallel_for pool length f] calls [f first last] on slices covering 0 to
+ * length-1, in all the domains of the pool, and returns once they are all
+ * done (reraising the first exception, if any). Slices are chunk rows long
+ * (by default, enough for 8 slices per domain). A pool must run only one
+ * job at a time. *)
+let parallel_for pool ?chunk length f =
+    let nb_workers = List.length pool.domains + 1 in
+    let chunk = match chunk with
+        | Some c -> max 1 c
+        | None -> max 1024 (length / (8 * nb_workers)) in
+    let nb_chunks = (length + chunk - 1) / chunk in
+    if nb_chunks <= 1 || nb_workers = 1 then (
+        if length > 0 then f 0 length
+    ) else (
+        let job =
+            { run = f ; length ; chunk ; nb_chunks ;
+              next_chunk = Atomic.make 0 ; done_chunks = Atomic.make 0 ;
+              error = Atomic.make None } in
+        Mutex.lock pool.mutex ;
+        pool.job <- Some job ;
+        pool.generation <- pool.generation + 1 ;
+        Condition.broadcast pool.new_job ;
+        Mutex.unlock pool.mutex ;
+        work pool job ;
+        Mutex.lock pool.mutex ;
+        while Atomic.get job.done_chunks < nb_chunks do
+            Condition.wait pool.job_done pool.mutex
+        done ;
+        pool.job <- None ;
+        Mutex.unlock pool.mutex ;
+        match Atomic.get job.error with
+        | Some e -> raise e
+        | None -> ()
+    )
+
+module Make (Glop : GLOP) =
+struct
+    open Glop
+
+    (* Same as Glop.vertex_array_fill and Glop.color_array_fill but f is
+     * called on slices of the array in parallel, so it must only write
+     * the given rows. *)
+    let vertex_array_fill pool ?chunk len f =
+        let arr = make_vertex_array len in
+        parallel_for pool ?chunk len (f arr) ;
+        arr
+
+    let color_array_fill pool ?chunk len f =
+        let arr = make_color_array len in
+        parallel_for pool ?chunk len (f arr) ;
+        arr
+end
@@ -0,0 +1,83 @@
+(* Specs for float vertex and color arrays, of either precision *)
+open Algen_intf
+open Glop_base
+
+module K = Algen_impl.FloatField
+
+let blit_matrix (m : float array array) (buf : matrix_buffer) =
+    for c = 0 to 3 do
+        let col = Array.unsafe_get m c in
+        for r = 0 to 3 do
+            Bigarray.Array1.unsafe_set buf (c*4 + r) (Array.unsafe_get col r)
+        done
+    done
+
+module type FLOAT_ELT =
+sig
+    type elt
+    val kind : (float, elt) Bigarray.kind
+    val set : (float, elt, Bigarray.c_layout) Bigarray.Array2.t -> int -> int -> float -> unit
+    (* Given here, where the kind is known, so that it's not a generic set *)
+end
+
+module Float64 =
+struct
+    type elt = Bigarray.float64_elt
+    let kind = Bigarray.float64
+    let set (arr : (float, elt, Bigarray.c_layout) Bigarray.Array2.t) i j (x : float) =
+        Bigarray.Array2.set arr i j x
+end
+
+module Float32 =
+struct
+    type elt = Bigarray.float32_elt
+    let kind = Bigarray.float32
+    let set (arr : (float, elt, Bigarray.c_layout) Bigarray.Array2.t) i j (x : float) =
+        Bigarray.Array2.set arr i j x
+end
+
+module Make
+    (Elt : FLOAT_ELT)
+    (Dim : CONF_INT)
+    (CDim : CONF_INT) :
+    GLOPSPEC with module Dim = Dim
+             and type vertex_array = (float, Elt.elt, Bigarray.c_layout) Bigarray.Array2.t
+             and module CDim = CDim
+             and type color_array = (float, Elt.elt, Bigarray.c_layout) Bigarray.Array2.t
+             and type interleaved_array = (float, Elt.elt, Bigarray.c_layout) Bigarray.Array2.t
+             and module K = K =
+struct
+    module Dim = Dim
+    module CDim = CDim
+    module K = K
+    module KC = K
+    type vertex_array = (float, Elt.elt, Bigarray.c_layout) Bigarray.Array2.t
+    let make_vertex_array nbv =
+        Bigarray.Array2.create Elt.kind Bigarray.c_layout nbv (Dim.v)
+    let vertex_array_set (arr : vertex_array) i (vec : float array) =
+        for c = 0 to Array.length vec - 1 do
+            Elt.set arr i c (Array.unsafe_get vec c)
+        done
+    let vertex_array_set_coord (arr : vertex_array) i c k =
+        Elt.set arr i c k
+    type color_array = (float, Elt.elt, Bigarray.c_layout) Bigarray.Array2.t
+    let make_color_array nbv =
+        Bigarray.Array2.create Elt.kind Bigarray.c_layout nbv (CDim.v)
+    let color_array_set (arr : color_array) i (vec : float array) =
+        for c = 0 to Array.length vec - 1 do
+            Elt.set arr i c (Array.unsafe_get vec c)
+        done
+    let color_array_set_coord (arr : color_array) i c k =
+        Elt.set arr i c k
+    let blit_matrix = blit_matrix
+    type interleaved_array = (float, Elt.elt, Bigarray.c_layout) Bigarray.Array2.t
+    let make_interleaved_array nbv =
+        Bigarray.Array2.create Elt.kind Bigarray.c_layout nbv (Dim.v + CDim.v)
+    let interleaved_array_set (arr : interleaved_array) i (vec : float array) (col : float array) =
+        for c = 0 to Array.length vec - 1 do
+            Elt.set arr i c (Array.unsafe_get vec c)
+        done ;
+        for c = 0 to Array.length col - 1 do
+            Elt.set arr i (Dim.v + c) (Array.unsafe_get col c)
+        done
+end
@@ -3,6 +3,15 @@ open Glop_base
 
 module K = Algen_impl.NatIntField (struct let v = 16 end)
 
+let blit_matrix (m : nativeint array array) (buf : matrix_buffer) =
+    for c = 0 to 3 do
+        let col = Array.unsafe_get m c in
+        for r = 0 to 3 do
+            Bigarray.Array1.unsafe_set buf (c*4 + r)
+                (Nativeint.to_float (Array.unsafe_get col r) /. 65536.)
+        done
+    done
+
 module Spec
     (Dim : CONF_INT)
     (CDim : CONF_INT) :
@@ -10,6 +19,7 @@ module Spec
              and type vertex_array = (nativeint, Bigarray.nativeint_elt, Bigarray.c_layout) Bigarray.Array2.t
              and module CDim = CDim
              and type color_array = (nativeint, Bigarray.nativeint_elt, Bigarray.c_layout) Bigarray.Array2.t
+             and type interleaved_array = (nativeint, Bigarray.nativeint_elt, Bigarray.c_layout) Bigarray.Array2.t
              and module K = K =
 struct
     module Dim = Dim
@@ -21,9 +31,20 @@ struct
         Bigarray.Array2.create Bigarray.nativeint Bigarray.c_layout nbv (Dim.v)
     let vertex_array_set arr i vec =
         Array.iteri (fun c v -> Bigarray.Array2.set arr i c v) vec
+    let vertex_array_set_coord (arr : vertex_array) i c k =
+        Bigarray.Array2.set arr i c k
     type color_array = (nativeint, Bigarray.nativeint_elt, Bigarray.c_layout) Bigarray.Array2.t
     let make_color_array nbv =
         Bigarray.Array2.create Bigarray.nativeint Bigarray.c_layout nbv (CDim.v)
     let color_array_set arr i vec =
         Array.iteri (fun c v -> Bigarray.Array2.set arr i c v) vec
+    let color_array_set_coord (arr : color_array) i c k =
+        Bigarray.Array2.set arr i c k
+    let blit_matrix = blit_matrix
+    type interleaved_array = (nativeint, Bigarray.nativeint_elt, Bigarray.c_layout) Bigarray.Array2.t
+    let make_interleaved_array nbv =
+        Bigarray.Array2.create Bigarray.nativeint Bigarray.c_layout nbv (Dim.v + CDim.v)
+    let interleaved_array_set arr i vec col =
+        Array.iteri (fun c v -> Bigarray.Array2.set arr i c v) vec ;
+        Array.iteri (fun c v -> Bigarray.Array2.set arr i (Dim.v + c) v) col
 end
@@ -0,0 +1,4 @@
+(* Vertex and color arrays are single precision since GLES has no doubles *)
+module K = Glop_spec_float.K
+
+module Spec = Glop_spec_float.Make (Glop_spec_float.Float32)
@@ -9,48 +9,178 @@ struct
      * It's thus the transformation from the view to its parent coord system. *)
     type transfo_dir = View_to_parent | Parent_to_view
     type positioner = transfo_dir -> M.t
+
+    (* What a view paints, in its own coordinates, so that it can be culled
+     * when out of sight. Box is given by two opposite corners. *)
+    type bounds = Unbounded | Empty | Sphere of V.t * K.t | Box of V.t * V.t
+
+    (* Bounding spheres used for culling, in floats *)
+    type sphere = Everywhere | Nowhere | Around of float array * float
+
+    (* Time spent and draws submitted by a painter during a frame, measured
+     * only when frame stats are enabled (see set_frame_stats) *)
+    type painter_stats = {
+        mutable painter_frame : int ; (* when these stats were measured *)
+        mutable painter_time : float ;
+        mutable painter_draw_calls : int ;
+        mutable painter_vertices : int }
+
+    let make_painter_stats () =
+        { painter_frame = -1 ; painter_time = 0. ;
+          painter_draw_calls = 0 ; painter_vertices = 0 }
+
+    let measure_painter stats frame painter =
+        if frame_stats_enabled () then (
+            let t0 = frame_clock ()
+            and d0 = frame_draw_calls ()
+            and v0 = frame_vertices () in
+            painter () ;
+            stats.painter_frame <- frame ;
+            stats.painter_time <- frame_clock () -. t0 ;
+            stats.painter_draw_calls <- frame_draw_calls () - d0 ;
+            stats.painter_vertices <- frame_vertices () - v0
+        ) else painter ()
+
     type viewable = {
         name             : string ;
         painter          : painter ;
         positioner       : positioner ;
         mutable parent   : viewable option ;
-        mutable children : viewable list
+        mutable children : viewable list ;
+        (* If cached, the positioner is called only once and then only after
+         * each call to invalidate_viewable. *)
+        cached           : bool ;
+        mutable to_parent : M.t option ;
+        mutable to_view   : M.t option ;
+        (* Transformations from this view to the root and back, cached if this
+         * view and all its ancestors are (see world_of_view). *)
+        mutable to_root   : M.t option ;
+        mutable from_root : M.t option ;
+        bounds            : bounds ;
+        (* Bounds of this view and its descendants, in its own coordinates,
+         * valid only during frame number subtree_frame (or forever if -1) *)
+        mutable subtree       : sphere ;
+        mutable subtree_frame : int ;
+        (* Last time the painter was called by draw_viewable, without the
+         * descendants (painter_frame is a frame_count) *)
+        stats : painter_stats
     }
 
+    (* Subtree bounds of view and its ancestors may have changed *)
+    let rec forget_bounds view =
+        view.subtree_frame <- -2 ;
+        match view.parent with
+        | Some parent -> forget_bounds parent
+        | None -> ()
+
+    (* If a view has no world transformations cached then none of its
+     * descendants have, so we can stop there. *)
+    let rec forget_world view =
+        match view.to_root, view.from_root with
+        | None, None -> ()
+        | _ ->
+            view.to_root <- None ;
+            view.from_root <- None ;
+            List.iter forget_world view.children
+
+    (* Same without assuming anything from view itself (the root, for
+     * instance, never caches its world transformations but its children do) *)
+    let forget_world_of view =
+        view.to_root <- None ;
+        view.from_root <- None ;
+        List.iter forget_world view.children
+
+    (* To be called whenever the positioner of a cached view would return a
+     * different matrix. *)
+    let invalidate_viewable view =
+        view.to_parent <- None ;
+        view.to_view <- None ;
+        forget_world_of view ;
+        (match view.parent with
+        | Some parent -> forget_bounds parent
+        | None -> ())
+
     let rec viewable_set_parent ?parent view =
+        forget_world_of view ;
         match parent with
         | None ->
             (match view.parent with
             | None -> ()
             | Some prev_parent ->
+                forget_bounds prev_parent ;
                 view.parent <- None ;
                 prev_parent.children <-
                     List.filter (( != ) view) prev_parent.children)
         | Some new_parent ->
             (match view.parent with
             | None ->
+                forget_bounds new_parent ;
                 view.parent <- parent ;
                 new_parent.children <- (view::new_parent.children)
             | Some _ ->
                 viewable_set_parent view ;
                 viewable_set_parent ~parent:new_parent view)
 
-    let make_viewable ?parent name painter positioner =
+    let make_viewable ?parent ?(cached=false) ?(bounds=Unbounded) name painter positioner =
         let viewable =
             { name = name ;
               painter = painter ;
               positioner = positioner ; (* matrix transforming coords from this viewable to parent *)
               parent = None ;
-              children = [] } in
+              children = [] ;
+              cached = cached ;
+              to_parent = None ; to_view = None ;
+              to_root = None ; from_root = None ;
+              bounds = bounds ;
+              subtree = Everywhere ; subtree_frame = -2 ;
+              stats = make_painter_stats () } in
         viewable_set_parent ?parent viewable ;
         viewable
 
+    (* The positioner of view, cached if possible *)
+    let positioned get set dir view =
+        match get view with
+        | Some m -> m
+        | None ->
+            let m = view.positioner dir in
+            if view.cached then set view (Some m) ;
+            m
+
+    let view_to_parent =
+        positioned (fun v -> v.to_parent) (fun v m -> v.to_parent <- m) View_to_parent
+    let parent_to_view =
+        positioned (fun v -> v.to_view) (fun v m -> v.to_view <- m) Parent_to_view
+
+    (* Returns the transformation from view to root (or from root to view if
+     * inverse), which does not include the root positioner, and whether it
+     * could be cached. *)
+    let rec world_of_view inverse view =
+        match view.parent with
+        | None -> M.id, true
+        | Some parent ->
+            (match (if inverse then view.from_root else view.to_root) with
+            | Some m -> m, true
+            | None ->
+                let pm, cacheable = world_of_view inverse parent in
+                let m =
+                    if inverse then M.mul_mat (parent_to_view view) pm
+                    else M.mul_mat pm (view_to_parent view) in
+                let cacheable = cacheable && view.cached in
+                if cacheable then (
+                    if inverse then view.from_root <- Some m
+                    else view.to_root <- Some m) ;
+                m, cacheable)
+
+    let rec root_of view = match view.parent with
+        | None -> view
+        | Some parent -> root_of parent
+
     (* Sets the modelview to transform from root to dst, and returns root *)
     let root_to_viewable mult_mat dst =
         let rec to_root pos = match pos.parent with
             | None -> pos
             | Some parent ->
-                mult_mat (pos.positioner Parent_to_view) ;
+                mult_mat (parent_to_view pos) ;
                 to_root parent in
         to_root dst
 
@@ -59,32 +189,131 @@ struct
             | None -> root2src
             | Some parent -> prepend_next_view (view::root2src) parent in
         let root2src = prepend_next_view [] src in
-        List.iter (fun view -> mult_mat (view.positioner View_to_parent)) root2src
+        List.iter (fun view -> mult_mat (view_to_parent view)) root2src
 
     (* Returns the matrix that transform point coordinates in src to coordinates in dst *)
     let get_transform ?src ?dst () =
-        let m = ref M.id in
-        let mult_mat m' = m := M.mul_mat !m m' in
-        (* start from current transfo = identity matrix
-         * then mult current transfo by all transverse positions from dst to root -> gives
-         * the transfo from root to dst *)
-        (match dst with Some d -> root_to_viewable mult_mat d |> ignore | None -> ()) ;
-        (* then mult this by transfo from root to src, ie all positioners from root to src *)
-        (match src with Some s -> viewable_to_root mult_mat s | None -> ()) ;
-        (* m is then :
+        (* the transfo from root to dst... *)
+        let root_to_dst = match dst with
+            | Some d -> fst (world_of_view true d)
+            | None -> M.id
+        (* ...and from src to root *)
+        and src_to_root = match src with
+            | Some s -> fst (world_of_view false s)
+            | None -> M.id in
+        (* result is then :
          * (VN->dst) o ... o (root->V1) o (vN->root) o ... o (v1->v2) o (src->v1)
          *)
-        !m
+        M.mul_mat root_to_dst src_to_root
+
+    (* Culling *)
+
+    let point_of_vec v =
+        Array.init 3 (fun i -> if i < Array.length v then K.to_float v.(i) else 0.)
+
+    let dist a b =
+        let sq i = (a.(i) -. b.(i)) *. (a.(i) -. b.(i)) in
+        sqrt (sq 0 +. sq 1 +. sq 2)
+
+    let sphere_of_bounds = function
+        | Unbounded -> Everywhere
+        | Empty -> Nowhere
+        | Sphere (c, r) -> Around (point_of_vec c, K.to_float r)
+        | Box (a, b) ->
+            let a = point_of_vec a and b = point_of_vec b in
+            let c = Array.init 3 (fun i -> 0.5 *. (a.(i) +. b.(i))) in
+            Around (c, dist c a)
+
+    (* Bounding sphere of the transformation of a sphere by the affine m *)
+    let transform_sphere m = function
+        | Around (c, r) ->
+            let e col row = K.to_float m.(col).(row) in
+            let c' = Array.init 3 (fun i ->
+                e 0 i *. c.(0) +. e 1 i *. c.(1) +. e 2 i *. c.(2) +. e 3 i) in
+            let scale = ref 0. in
+            for col = 0 to 2 do
+                let n = sqrt (e col 0 *. e col 0 +. e col 1 *. e col 1 +. e col 2 *. e col 2) in
+                if n > !scale then scale := n
+            done ;
+            Around (c', r *. !scale)
+        | s -> s
+
+    let merge_spheres s1 s2 = match s1, s2 with
+        | Everywhere, _ | _, Everywhere -> Everywhere
+        | Nowhere, s | s, Nowhere -> s
+        | Around (c1, r1), Around (c2, r2) ->
+            let d = dist c1 c2 in
+            if d +. r2 <= r1 then s1 else
+            if d +. r1 <= r2 then s2 else
+            let r = 0.5 *. (d +. r1 +. r2) in
+            let k = (r -. r1) /. d in
+            Around (Array.init 3 (fun i -> c1.(i) +. k *. (c2.(i) -. c1.(i))), r)
+
+    let frame_count = ref 0
+
+    (* Returns the bounds of view and its descendants, in view coordinates,
+     * and whether they can be kept for later frames. *)
+    let rec subtree_sphere view =
+        if view.subtree_frame = -1 then view.subtree, true else
+        if view.subtree_frame = !frame_count then view.subtree, false else
+        let s, cacheable =
+            List.fold_left (fun (s, cacheable) child ->
+                let cs, child_cacheable = subtree_sphere child in
+                let cs = match cs with
+                    | Around _ -> transform_sphere (view_to_parent child) cs
+                    | _ -> cs in
+                merge_spheres s cs, cacheable && child_cacheable && child.cached)
+                (sphere_of_bounds view.bounds, true) view.children in
+        view.subtree <- s ;
+        view.subtree_frame <- if cacheable then -1 else !frame_count ;
+        s, cacheable
+
+    (* Tells if the sphere, in current modelview coordinates, is entirely out
+     * of the current view frustum, by comparing it with the frustum planes
+     * (extracted from the rows of projection * modelview). *)
+    let outside_frustum = function
+        | Everywhere -> false
+        | Nowhere -> true
+        | Around (c, r) ->
+            let m = M.mul_mat (get_projection ()) (get_modelview ()) in
+            let e col row = K.to_float m.(col).(row) in
+            let outside row sign =
+                let coef col = e col 3 +. sign *. e col row in
+                let a = coef 0 and b = coef 1 and c' = coef 2 and d = coef 3 in
+                let n = sqrt (a *. a +. b *. b +. c' *. c') in
+                a *. c.(0) +. b *. c.(1) +. c' *. c.(2) +. d < -. r *. n in
+            outside 0 1. || outside 0 (-1.) ||
+            outside 1 1. || outside 1 (-1.) ||
+            outside 2 1. || outside 2 (-1.)
+
+    type cull_stats = { mutable drawn : int ; mutable culled : int }
+
+    (* Number of viewables drawn and culled (not counting their descendants)
+     * during the last draw_viewable *)
+    let cull_stats = { drawn = 0 ; culled = 0 }
 
-    let draw_viewable camera =
+    let draw_viewable ?(cull=true) camera =
+        incr frame_count ;
+        cull_stats.drawn <- 0 ;
+        cull_stats.culled <- 0 ;
         let rec aux pos =
             push_modelview () ;
-            mult_modelview (pos.positioner View_to_parent) ;
-            pos.painter () ;
-            List.iter aux pos.children ;
+            mult_modelview (view_to_parent pos) ;
+            if cull && outside_frustum (fst (subtree_sphere pos)) then
+                cull_stats.culled <- cull_stats.culled + 1
+            else (
+                cull_stats.drawn <- cull_stats.drawn + 1 ;
+                measure_painter pos.stats !frame_count pos.painter ;
+                List.iter aux pos.children) ;
             pop_modelview () in
-        set_modelview M.id ;
-        aux (root_to_viewable mult_modelview camera)
+        set_modelview (fst (world_of_view true camera)) ;
+        aux (root_of camera)
+
+    (* Draw what the camera sees into a render target, that can then be
+     * composited every frame with composite_render_target instead of being
+     * repainted (for static layers) *)
+    let draw_viewable_into ?cull target camera =
+        draw_into target (fun () -> draw_viewable ?cull camera)
 
     (* Once in a drawer we may want to clip some objects.
      * This function returns the screen corner coordinates according to
@@ -153,15 +382,51 @@ struct
                 (K.neg u) u
                 z_near z_far
 
+    let redraw_mutex = Mutex.create ()
+    let redraw_cond = Condition.create ()
+    let redraw_requested = ref true
+
+    (* Asks display to draw a new frame, when drawing only on demand.
+     * Can be called from any thread. *)
+    let request_redraw () =
+        Mutex.lock redraw_mutex ;
+        redraw_requested := true ;
+        Condition.signal redraw_cond ;
+        Mutex.unlock redraw_mutex
+
+    let wait_redraw () =
+        Mutex.lock redraw_mutex ;
+        while not !redraw_requested do
+            Condition.wait redraw_cond redraw_mutex
+        done ;
+        redraw_requested := false ;
+        Mutex.unlock redraw_mutex
+
     let want_exit = ref false
-    let exit () = want_exit := true
+    (* Wakes up whatever display is blocked on, besides redraws *)
+    let on_exit = ref ignore
+    let exit () =
+        want_exit := true ;
+        request_redraw () ;
+        !on_exit ()
 
-    (* Some GL libs have a different GL context per threads, so you
+    (* Returns a function that sleeps until it's time to start the next
+     * frame, so that at most fps frames are drawn per second. When late,
+     * it does not try to catch up. *)
+    let frame_pacer fps =
+        let period = 1. /. fps in
+        let next = ref (frame_clock ()) in
+        fun () ->
+            next := !next +. period ;
+            let now = frame_clock () in
+            if !next > now then Thread.delay (!next -. now)
+            else next := now
+
+    (* Starts the thread reading events and returns a function that returns
+     * the new window size, if it changed since last call.
+     * Some GL libs have a different GL context per threads, so you
      * must not call any GL functions in the on_event callback. *)
-    let display ?depth ?alpha ?double_buffer
-                ?(title="View") ?(on_event=ignore)
-                ?(width=800) ?(height=480)
-                ?(get_projection=get_projection_default) painters =
+    let start_event_thread on_event =
         let new_size_mutex = Mutex.create () in
         let new_size = ref None in
         let synchronize l f x =
@@ -172,30 +437,200 @@ struct
             with e ->
                 Mutex.unlock l ;
                 raise e in
-        let handle_event () =
-            let ev = next_event true in
-            (match ev with
-                | Some Resize (w, h) ->
-                    synchronize new_size_mutex (fun x -> new_size := x) (Some (w, h))
-                | _ -> ()) ;
-            (match ev with Some e -> on_event e | None -> ()) in
+        (* Drain all pending events at once *)
+        let events = make_event_buffer 64 in
+        let handle_events () =
+            for i = 0 to poll_events true events - 1 do
+                let ev = event_of_row events i in
+                (match ev with
+                    | Resize (w, h) ->
+                        synchronize new_size_mutex (fun x -> new_size := x) (Some (w, h))
+                    | _ -> ()) ;
+                on_event ev
+            done in
         let forever f x =
             ignore (while true do f x done) in
         let event_thread () =
-            forever handle_event () in
+            forever handle_events () in
+        ignore (Thread.create event_thread ()) ;
+        synchronize new_size_mutex (fun () ->
+            let s = !new_size in
+            new_size := None ;
+            s)
+
+    (* Stats of each painter given to display, during the last frame *)
+    let display_stats = ref [||]
+
+    (* Draws frames until exit is called. With swap_interval, swap_buffers
+     * waits for that many vertical retraces; with fps, frames are drawn at
+     * most that often; and with on_demand, a frame is drawn only after an
+     * event (including resizes) or a call to request_redraw, so that nothing
+     * is done while idle. *)
+    let display ?depth ?alpha ?double_buffer ?offscreen
+                ?(title="View") ?(on_event=ignore)
+                ?(width=800) ?(height=480)
+                ?(get_projection=get_projection_default)
+                ?swap_interval ?fps ?(on_demand=false) painters =
+        init ?depth ?alpha ?double_buffer ?offscreen title width height ;
+        (match swap_interval with
+            | Some n -> ignore (set_swap_interval n)
+            | None -> ()) ;
+        set_projection (get_projection K.one K.one) ;
+        let on_event =
+            if on_demand then (fun ev -> on_event ev ; request_redraw ())
+            else on_event in
+        let resized = start_event_thread on_event in
+        let pace = match fps with
+            | Some fps -> frame_pacer fps
+            | None -> ignore in
+        display_stats := Array.of_list (List.map (fun _ -> make_painter_stats ()) painters) ;
+        let frame = ref 0 in
         let next_frame () =
-            synchronize new_size_mutex (fun () ->
-                match !new_size with
-                    | Some (w, h) ->
-                        set_projection_to_winsize get_projection w h ;
-                        new_size := None
-                    | _ -> ()) () ;
-            List.iter ((|>) ()) painters ;
-            swap_buffers () in
-        init ?depth ?alpha ?double_buffer title width height ;
+            (match resized () with
+                | Some (w, h) -> set_projection_to_winsize get_projection w h
+                | None -> ()) ;
+            List.iteri (fun i painter ->
+                measure_painter !display_stats.(i) !frame painter) painters ;
+            incr frame ;
+            swap_buffers () ;
+            pace () in
+        while not !want_exit do
+            if on_demand then wait_redraw () ;
+            if not !want_exit then next_frame ()
+        done ;
+        Glop.exit ()
+
+    (* Render commands, so that frames can be built by a thread while the
+     * one owning the GL context submits the previous ones. Arrays given to
+     * commands must not be modified until the frame is rendered. *)
+    type command =
+        | Clear of C.t option * K.t option
+        | Set_projection of M.t
+        | Set_modelview of M.t
+        | Mult_modelview of M.t
+        | Push_modelview
+        | Pop_modelview
+        | Render of render_type * vertex_array * color_specs
+        | Call of (unit -> unit) (* any other GL calls, run on the GL thread *)
+        | End_frame
+
+    (* Ring of commands, from the thread building frames to the GL thread.
+     * Each side blocks when there is nothing it can do, until the other
+     * side or exit wakes it up. *)
+    type command_queue = {
+        commands : command array ;
+        mutable head : int ;    (* next command to run *)
+        mutable tail : int ;    (* next free slot *)
+        mutable frames : int ;  (* number of End_frame in the queue *)
+        mutable closed : bool ; (* once closed, nothing blocks anymore *)
+        mutex : Mutex.t ;
+        not_empty : Condition.t ;
+        not_full : Condition.t } (* also signaled when a frame is done *)
+
+    let make_command_queue len =
+        { commands = Array.make len End_frame ;
+          head = 0 ; tail = 0 ; frames = 0 ; closed = false ;
+          mutex = Mutex.create () ;
+          not_empty = Condition.create () ;
+          not_full = Condition.create () }
+
+    let close_command_queue q =
+        Mutex.lock q.mutex ;
+        q.closed <- true ;
+        Condition.broadcast q.not_empty ;
+        Condition.broadcast q.not_full ;
+        Mutex.unlock q.mutex
+
+    (* Commands pushed once the queue is closed are dropped *)
+    let push_command q c =
+        Mutex.lock q.mutex ;
+        while not q.closed && q.tail - q.head >= Array.length q.commands do
+            Condition.wait q.not_full q.mutex
+        done ;
+        if not q.closed then (
+            q.commands.(q.tail mod Array.length q.commands) <- c ;
+            (match c with End_frame -> q.frames <- q.frames + 1 | _ -> ()) ;
+            q.tail <- q.tail + 1 ;
+            Condition.signal q.not_empty) ;
+        Mutex.unlock q.mutex
+
+    (* Waits for a command, or returns None once the queue is closed *)
+    let pop_command q =
+        Mutex.lock q.mutex ;
+        while not q.closed && q.head = q.tail do
+            Condition.wait q.not_empty q.mutex
+        done ;
+        let c =
+            if q.head = q.tail then None else (
+                let i = q.head mod Array.length q.commands in
+                let c = q.commands.(i) in
+                q.commands.(i) <- End_frame ; (* do not retain arrays *)
+                q.head <- q.head + 1 ;
+                Condition.broadcast q.not_full ;
+                Some c
+            ) in
+        Mutex.unlock q.mutex ;
+        c
+
+    let frame_done q =
+        Mutex.lock q.mutex ;
+        q.frames <- q.frames - 1 ;
+        Condition.broadcast q.not_full ;
+        Mutex.unlock q.mutex
+
+    (* Waits until less than max_ahead frames are queued *)
+    let wait_frames q max_ahead =
+        Mutex.lock q.mutex ;
+        while not q.closed && q.frames >= max_ahead do
+            Condition.wait q.not_full q.mutex
+        done ;
+        Mutex.unlock q.mutex
+
+    let run_command = function
+        | Clear (color, depth) -> clear ?color ?depth ()
+        | Set_projection m -> set_projection m
+        | Set_modelview m -> set_modelview m
+        | Mult_modelview m -> mult_modelview m
+        | Push_modelview -> push_modelview ()
+        | Pop_modelview -> pop_modelview ()
+        | Render (t, vertices, colors) -> render t vertices colors
+        | Call f -> f ()
+        | End_frame -> swap_buffers ()
+
+    (* Same as display, but builders do not call GL: they are given a
+     * function to emit commands, and run in their own thread, at most
+     * max_ahead frames ahead of the GL thread that runs these commands. *)
+    let display_queued ?depth ?alpha ?double_buffer ?offscreen
+                       ?(title="View") ?(on_event=ignore)
+                       ?(width=800) ?(height=480)
+                       ?(get_projection=get_projection_default)
+                       ?(queue_length=65536) ?(max_ahead=2) builders =
+        init ?depth ?alpha ?double_buffer ?offscreen title width height ;
         set_projection (get_projection K.one K.one) ;
-        ignore (Thread.create event_thread ()) ;
-        while not !want_exit do next_frame () done ;
+        let resized = start_event_thread on_event in
+        let q = make_command_queue queue_length in
+        on_exit := (fun () -> close_command_queue q) ;
+        let emit = push_command q in
+        let builder_thread () =
+            while not !want_exit do
+                wait_frames q max_ahead ;
+                if not !want_exit then (
+                    List.iter (fun b -> b emit) builders ;
+                    emit End_frame)
+            done in
+        ignore (Thread.create builder_thread ()) ;
+        while not !want_exit do
+            match pop_command q with
+            | None -> ()
+            | Some End_frame ->
+                run_command End_frame ;
+                frame_done q ;
+                (match resized () with
+                    | Some (w, h) -> set_projection_to_winsize get_projection w h
+                    | None -> ())
+            | Some c -> run_command c
+        done ;
+        close_command_queue q ;
         Glop.exit ()
 
     (* Simple function to display some geometry in a separate window.
@@ -244,7 +679,10 @@ struct
             | UnZoom _ ->
                 cam_pos.(3).(2) <- K.add cam_pos.(3).(2) (K.of_float 0.02) ;
                 Printf.printf "camera height is now %s.\n%!" (K.to_string cam_pos.(3).(2))
-            | Clic _ | UnClic _ | Move _ | Resize _ -> () in
+            | Key_press (k, _) when k = 0xff1b (* Escape *) || k = Char.code 'q' ->
+                exit ()
+            | Clic _ | UnClic _ | Move _ | Resize _
+            | Key_press _ | Key_release _ | Enter _ | Leave _ | Focus _ -> () in
         let get_projection r u =
             M.frustum (K.neg r) r (K.neg u) u z_near z_far in
         display ~depth:true ~alpha:true ?title ~on_event ?width ?height ~get_projection [painter]
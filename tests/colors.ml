@@ -26,5 +26,5 @@ let main =
         render Triangle_fans (square (K.neg d)) (Uniq C.red) ;
         render Triangle_fans (square K.zero) (Uniq C.green) ;
         render Triangle_fans (square d) (Uniq C.blue) in
-    View.display ~title:"colors" ~on_event:on_event [paint_colors]
+    View.display ~title:"colors" ~on_event:on_event ~on_demand:true [paint_colors]
 
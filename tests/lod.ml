@@ -0,0 +1,63 @@
+(* Check the min/max pyramid of Glop_lod against brute force (no GL needed). *)
+open Glop_lod
+
+let nb_samples = 1000
+
+(* Several samples per x, so that search has ties to skip *)
+let x_of i = float_of_int (i / 3)
+let y_of i = sin (float_of_int i *. 0.37) *. float_of_int (i mod 17)
+
+let check_levels s =
+    Array.iteri (fun k l ->
+        let size = bucket_size s k in
+        assert (s.length >= 2 * size) ;
+        for b = 0 to (s.length - 1) / size do
+            let mi = ref infinity and ma = ref neg_infinity in
+            for i = b * size to min s.length ((b + 1) * size) - 1 do
+                mi := min !mi (y_of i) ;
+                ma := max !ma (y_of i)
+            done ;
+            assert (l.mins.(b) = !mi) ;
+            assert (l.maxs.(b) = !ma)
+        done) s.levels ;
+    (* No level is missing *)
+    assert (s.length < 2 * bucket_size s (Array.length s.levels))
+
+let brute_search s x =
+    let rec aux i = if i >= s.length || s.xs.(i) >= x then i else aux (i + 1) in
+    aux 0
+
+let main =
+    let s = make_series ~factor:3 () in
+    for i = 0 to nb_samples - 1 do
+        append_sample s (x_of i) (y_of i) ;
+        (* Check across every level boundary (and a few more) *)
+        if i < 100 || i mod 37 = 0 || i = nb_samples - 1 then check_levels s
+    done ;
+    assert (Array.length s.levels = 5) ;
+    (* search *)
+    List.iter (fun x ->
+        assert (search_series s x = brute_search s x))
+        [ -1. ; 0. ; 0.5 ; 1. ; 42. ; 42.1 ; 332. ; 333. ; 334. ] ;
+    (* An orthographic projection of x0..x1 to -1..1 *)
+    List.iter (fun (x0, x1) ->
+        let a = 2. /. (x1 -. x0) in
+        let b = -. (x1 +. x0) /. (x1 -. x0) in
+        let first, last = projected_range s a b in
+        assert (first = max 0 (brute_search s x0 - 1)) ;
+        assert (last = min (s.length - 1) (brute_search s x1)) ;
+        (* Same with x flipped *)
+        assert (projected_range s (-. a) (-. b) = (first, last)))
+        [ 0., 333. ; 10., 20. ; 10.5, 11.5 ; -50., 5. ; 300., 400. ; 500., 600. ] ;
+    assert (projected_range s 0. 0. = (0, s.length - 1)) ;
+    (* pick_level takes the finest level with few enough buckets *)
+    List.iter (fun (n, max_buckets) ->
+        let k = pick_level s n max_buckets in
+        if n <= max_buckets then assert (k = -1) else (
+            assert (k >= 0 && k < Array.length s.levels) ;
+            let fits k = n / bucket_size s k <= max_buckets in
+            assert (fits k || k = Array.length s.levels - 1) ;
+            assert (k = 0 || not (fits (k - 1)))
+        ))
+        [ 10, 100 ; 1000, 1000 ; 1000, 500 ; 1000, 100 ; 1000, 10 ; 1000, 1 ] ;
+    assert (pick_level (make_series ()) 1000 10 = -1)
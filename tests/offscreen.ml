@@ -0,0 +1,94 @@
+(* Render into an offscreen surface (no X needed) and read the pixels back. *)
+module Glop = Glop_impl.Glop2D
+open Glop
+
+let width = 64 and height = 48
+
+let pixel_at pixels x y (r, g, b) =
+    let i = 4 * (y * width + x) in
+    pixels.{i} = r && pixels.{i+1} = g && pixels.{i+2} = b
+
+let pixel_is pixels rgb = pixel_at pixels 0 0 rgb
+
+let all_pixels_are pixels rgb =
+    let rec loop i =
+        i >= width * height || (pixel_at pixels (i mod width) (i / width) rgb && loop (i + 1)) in
+    loop 0
+
+let main =
+    init ~offscreen:true "offscreen" width height ;
+    set_viewport 0 0 width height ;
+    let pixels =
+        Bigarray.Array1.create Bigarray.int8_unsigned Bigarray.c_layout (width * height * 4) in
+    (* Synchronous read *)
+    clear ~color:C.red () ;
+    read_pixels 0 0 width height pixels ;
+    assert (pixel_is pixels (255, 0, 0)) ;
+    swap_buffers () ;
+    (* With depth 2, asynchronous reads give nothing at the first call then
+     * the frame of the previous call, except on GLES 1 (the only backend with
+     * fixed point coordinates) where they always read the current frame. *)
+    let synchronous = Obj.tag (Obj.repr (K.of_float 1.)) = Obj.custom_tag in
+    let colors = [| C.green ; C.blue ; C.white ; C.black |]
+    and expected = [| 0, 255, 0 ; 0, 0, 255 ; 255, 255, 255 ; 0, 0, 0 |] in
+    let reader = make_pixel_reader ~depth:2 width height in
+    Array.iteri (fun i color ->
+        clear ~color () ;
+        Bigarray.Array1.fill pixels 127 ;
+        let copied = read_pixels_async reader pixels in
+        if synchronous then (
+            assert copied ;
+            assert (all_pixels_are pixels expected.(i))
+        ) else if i = 0 then
+            assert (not copied)
+        else (
+            assert copied ;
+            assert (all_pixels_are pixels expected.(i-1))
+        ) ;
+        swap_buffers ()) colors ;
+    release_pixel_reader reader ;
+    (* Render into a texture, then composite it into the window *)
+    let target = make_render_target 32 32 in
+    draw_into target (fun () -> clear ~color:C.blue ()) ;
+    assert (get_viewport () = (0, 0, width, height)) ;
+    clear ~color:C.black () ;
+    composite_render_target target ;
+    read_pixels 0 0 width height pixels ;
+    assert (pixel_is pixels (0, 0, 255)) ;
+    release_render_target target ;
+    (* Texture a quad covering the window with a green then yellow texture *)
+    let texels = Bigarray.(Array3.create int8_unsigned c_layout 1 2 3) in
+    Bigarray.Array3.fill texels 0 ;
+    texels.{0, 0, 1} <- 255 ;
+    let texture = make_texture ~filter:Nearest (Byte_texels texels) in
+    let corners = [| -1., -1. ; 1., -1. ; 1., 1. ; -1., 1. |] in
+    let quad = vertex_array_init 4 (fun i -> let x, y = corners.(i) in [| x ; y |])
+    and texcoords = make_texcoord_array 4 in
+    Array.iteri (fun i (x, y) ->
+        texcoord_array_set texcoords i ((x +. 1.) /. 2.) ((y +. 1.) /. 2.)) corners ;
+    render ~texture:(texture, texcoords) Triangle_fans quad (Uniq C.white) ;
+    read_pixels 0 0 width height pixels ;
+    assert (pixel_is pixels (0, 255, 0)) ;
+    texels.{0, 0, 0} <- 255 ;
+    update_texture texture 0 0 (Byte_texels texels) ;
+    render ~texture:(texture, texcoords) Triangle_fans quad (Uniq C.white) ;
+    read_pixels 0 0 width height pixels ;
+    assert (pixel_is pixels (255, 255, 0)) ;
+    release_texture texture ;
+    (* Two instances of the right half of the quad, moved left for the first *)
+    let half = vertex_array_init 4 (fun i -> let x, y = corners.(i) in [| (x +. 1.) /. 2. ; y |])
+    and offsets = vertex_array_init 2 (fun i -> [| float_of_int (i - 1) ; 0. |])
+    and colors = color_array_init 2 (fun i -> if i = 0 then C.red else C.blue) in
+    render_instanced Triangle_fans half offsets (Array colors) ;
+    read_pixels 0 0 width height pixels ;
+    assert (pixel_at pixels 0 (height/2) (255, 0, 0)) ;
+    assert (pixel_at pixels (width-1) (height/2) (0, 0, 255)) ;
+    (* The second instance halved vertically leaves the corners of its half *)
+    let scales = vertex_array_init 2 (fun i -> [| 1. ; if i = 0 then 1. else 0.5 |]) in
+    clear ~color:C.black () ;
+    render_instanced ~scales Triangle_fans half offsets (Array colors) ;
+    read_pixels 0 0 width height pixels ;
+    assert (pixel_at pixels 0 (height-1) (255, 0, 0)) ;
+    assert (pixel_at pixels (width-1) (height/2) (0, 0, 255)) ;
+    assert (pixel_at pixels (width-1) (height-1) (0, 0, 0)) ;
+    exit ()